@@ -1,11 +1,18 @@
 #pragma once
 #include <mutex>
+#include <atomic>
+#include <thread>
+#include <algorithm>
 #ifdef _WIN32
 #include <Windows.h>
 #else
 #include <sys/mman.h>
 #endif
 
+// 累计向系统申请与释放的字节数，用于统计
+inline std::atomic<std::size_t> systemAllocBytes{ 0 };
+inline std::atomic<std::size_t> systemDeallocBytes{ 0 };
+
 // 向系统申请内存
 static void* SystemAlloc(std::size_t bytes)
 {
@@ -19,9 +26,48 @@ static void* SystemAlloc(std::size_t bytes)
 		throw std::bad_alloc();
 #endif
 
+	systemAllocBytes.fetch_add(bytes, std::memory_order_relaxed);
+	return ptr;
+}
+
+// 保留一段地址空间，物理页在首次写入时才分配，不计入系统的提交量
+// 也不计入systemAllocBytes，由使用者按实际写入的部分计入
+// Windows上没有对应的方式，直接提交
+static void* SystemReserve(std::size_t bytes)
+{
+#ifdef _WIN32
+	void* ptr = VirtualAlloc(0, bytes, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (ptr == nullptr)
+		throw std::bad_alloc();
+#else
+	void* ptr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (ptr == MAP_FAILED)
+		throw std::bad_alloc();
+#endif
 	return ptr;
 }
 
+// 向系统申请按align字节对齐的内存，align须为2的次方
+// mmap只保证4K对齐，而page cache按(1 << kPageShift)计算页号，因此需要更大的对齐
+static void* SystemAllocAligned(std::size_t bytes, std::size_t align)
+{
+#ifdef _WIN32
+	// VirtualAlloc返回的地址按64K对齐
+	return SystemAlloc(bytes);
+#else
+	// 多申请align字节，再将首尾多余部分还给系统
+	char* ptr = (char*)SystemAlloc(bytes + align);
+	char* aligned = (char*)(((std::size_t)ptr + align - 1) & ~(align - 1));
+
+	if (aligned != ptr)
+		munmap(ptr, aligned - ptr);
+	munmap(aligned + bytes, ptr + align - aligned);
+	systemDeallocBytes.fetch_add(align, std::memory_order_relaxed);
+
+	return aligned;
+#endif
+}
+
 // 向系统释放内存
 static void SystemDealloc(void* ptr, size_t bytes)
 {
@@ -29,10 +75,107 @@ static void SystemDealloc(void* ptr, size_t bytes)
 	VirtualFree(ptr, 0, MEM_RELEASE);
 #else
 	munmap(ptr, bytes);
+#endif
+	systemDeallocBytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+// 将SystemAllocAligned申请的内存调整为newBytes字节，物理页随映射移动，不复制数据
+// 返回调整后按align对齐的首地址，不支持时返回nullptr，原内存保持不变
+static void* SystemRemap(void* ptr, std::size_t oldBytes, std::size_t newBytes, std::size_t align)
+{
+#if defined(__linux__) && defined(MREMAP_FIXED)
+	// 先尝试原地调整
+	void* res = mremap(ptr, oldBytes, newBytes, 0);
+	if (res != MAP_FAILED)
+	{
+		systemAllocBytes.fetch_add(newBytes, std::memory_order_relaxed);
+		systemDeallocBytes.fetch_add(oldBytes, std::memory_order_relaxed);
+		return res;
+	}
+
+	// mremap自行选择的地址只保证4K对齐，先占住一段对齐的地址，再将原映射整体移过去
+	void* target = SystemAllocAligned(newBytes, align);
+	res = mremap(ptr, oldBytes, newBytes, MREMAP_MAYMOVE | MREMAP_FIXED, target);
+	if (res == MAP_FAILED)
+	{
+		SystemDealloc(target, newBytes);
+		return nullptr;
+	}
+	// 占住的地址已计入申请的字节数，原映射视为释放
+	systemDeallocBytes.fetch_add(oldBytes, std::memory_order_relaxed);
+	return res;
+#else
+	(void)ptr;
+	(void)oldBytes;
+	(void)newBytes;
+	(void)align;
+	return nullptr;
+#endif
+}
+
+// 建议系统用透明大页映射这段内存
+static void SystemAdviseHugePage(void* ptr, std::size_t bytes)
+{
+#ifdef MADV_HUGEPAGE
+	madvise(ptr, bytes, MADV_HUGEPAGE);
+#else
+	(void)ptr;
+	(void)bytes;
+#endif
+}
+
+// 将内存的物理页归还系统，保留地址空间，之后访问时由系统重新分配清零的物理页
+static void SystemRelease(void* ptr, std::size_t bytes)
+{
+#ifdef _WIN32
+	VirtualFree(ptr, bytes, MEM_DECOMMIT);
+#else
+	madvise(ptr, bytes, MADV_DONTNEED);
+#endif
+}
+
+// 重新提交SystemRelease归还的内存
+static void SystemRecommit(void* ptr, std::size_t bytes)
+{
+#ifdef _WIN32
+	if (VirtualAlloc(ptr, bytes, MEM_COMMIT, PAGE_READWRITE) == nullptr)
+		throw std::bad_alloc();
+#else
+	// 访问时由缺页自动重新提交，无需操作
+	(void)ptr;
+	(void)bytes;
 #endif
 }
 
-static std::mutex objPoolMtx;
+// 自旋锁，用于只有几条指令的临界区
+// 满足BasicLockable，可配合std::lock_guard/std::unique_lock使用
+class SpinLock
+{
+private:
+	std::atomic<bool> _locked{ false };
+
+public:
+	void lock()
+	{
+		while (_locked.exchange(true, std::memory_order_acquire))
+		{
+			// 等待期间只读，避免反复写缓存行
+			while (_locked.load(std::memory_order_relaxed))
+				std::this_thread::yield();
+		}
+	}
+
+	bool try_lock()
+	{
+		return !_locked.load(std::memory_order_relaxed)
+			&& !_locked.exchange(true, std::memory_order_acquire);
+	}
+
+	void unlock()
+	{
+		_locked.store(false, std::memory_order_release);
+	}
+};
 
 // 定长内存池
 template <class T>
@@ -62,6 +205,7 @@ public:
 				_memory = (char*)SystemAlloc(_allocSize);
 
 				_remainSize = _allocSize;
+				_totalBytes += _allocSize;
 			}
 
 
@@ -86,6 +230,12 @@ public:
 		*(void**)object = _freeList;
 		_freeList = (void*)object;
 	}
+
+	// 向系统申请的总字节数
+	std::size_t MemoryBytes() const
+	{
+		return _totalBytes;
+	}
 	
 private:
 	// 内存块头指针
@@ -100,6 +250,208 @@ private:
 
 	// 一次申请的内存块大小
 	int _allocSize = 128 * 1024;
+
+	// 向系统申请的总字节数
+	std::size_t _totalBytes = 0;
 	
 };
 
+
+// 线程安全的定长内存池，每种类型只有一个，全部为静态成员，常量初始化，任何时候都可使用
+// 每个线程持有一条本地链表(弹匣)，申请释放只访问本地链表，不加锁
+// 本地链表为空或过长时，与全局仓库整批交换；仓库和切分新内存块由自旋锁保护
+// 线程调用AttachThread后才使用本地链表，并在线程退出时归还仓库；未调用时每次直接访问仓库
+// AttachThread可能申请内存，因此只在持有锁时使用的类型(如Span)应在加锁之前调用
+template <class T>
+class ConcurrentObjectPool
+{
+	// 对象之间的链接、一批的数量等写在对象自身的内存中，至少需要三个指针大小
+	static constexpr std::size_t kAlign = (std::max)(alignof(T), alignof(void*));
+	static constexpr std::size_t kObjectSize = ((std::max)(sizeof(T), 3 * sizeof(void*)) + kAlign - 1) & ~(kAlign - 1);
+
+	// 一批约64K，大对象每批至少一个，小对象每批最多32个
+	static constexpr std::uint32_t kBatchSize = (std::uint32_t)(std::min)((std::max)(64 * 1024 / kObjectSize, (std::size_t)1), (std::size_t)32);
+
+	// 每次向系统申请的内存块大小
+	static constexpr std::size_t kSlabSize = (std::max)(kObjectSize, (std::size_t)128 * 1024);
+
+	// 仓库中一批对象的头部，写在第一个对象中，第一个字段与对象间的链接重合
+	struct Batch
+	{
+		void* next;
+		Batch* nextBatch;
+		std::uint32_t count;
+	};
+
+	// 每个线程的本地链表
+	struct Local
+	{
+		void* list;
+		std::uint32_t count;
+		bool attached;
+	};
+
+	// 线程退出时将本地链表归还仓库
+	struct Releaser
+	{
+		Releaser()
+		{
+			_local.attached = true;
+		}
+
+		~Releaser()
+		{
+			Local& local = _local;
+			if (local.count > 0)
+			{
+				std::lock_guard<SpinLock> lk(_lock);
+				PutBatch(local.list, local.count);
+			}
+			local = Local{};
+		}
+	};
+
+public:
+	ConcurrentObjectPool() = delete;
+
+	static T* New()
+	{
+		Local& local = _local;
+		void* object;
+		if (local.list == nullptr && !local.attached)
+		{
+			object = PopOne();
+		}
+		else
+		{
+			if (local.list == nullptr)
+			{
+				std::lock_guard<SpinLock> lk(_lock);
+				local.list = TakeBatch(local.count);
+			}
+			object = local.list;
+			local.list = *(void**)object;
+			--local.count;
+		}
+
+		new(object)T();
+		return (T*)object;
+	}
+
+	static void Delete(T* object)
+	{
+		object->~T();
+
+		Local& local = _local;
+		if (!local.attached)
+		{
+			*(void**)object = nullptr;
+			std::lock_guard<SpinLock> lk(_lock);
+			PutBatch(object, 1);
+			return;
+		}
+
+		*(void**)object = local.list;
+		local.list = object;
+		// 本地保留一批，多出的一批归还仓库
+		if (++local.count >= 2 * kBatchSize)
+		{
+			void* tail = local.list;
+			for (std::uint32_t i = 1; i < kBatchSize; ++i)
+				tail = *(void**)tail;
+
+			void* head = local.list;
+			local.list = *(void**)tail;
+			local.count -= kBatchSize;
+			*(void**)tail = nullptr;
+
+			std::lock_guard<SpinLock> lk(_lock);
+			PutBatch(head, kBatchSize);
+		}
+	}
+
+	// 当前线程启用本地链表，首次调用时注册线程退出时的归还
+	static void AttachThread()
+	{
+		static thread_local Releaser releaser;
+		(void)releaser;
+	}
+
+	// 向系统申请的总字节数
+	static std::size_t MemoryBytes()
+	{
+		return _totalBytes.load(std::memory_order_relaxed);
+	}
+
+private:
+	// 从仓库取出一批，仓库为空时从内存块切分，由_lock保护
+	static void* TakeBatch(std::uint32_t& count)
+	{
+		if (_batches != nullptr)
+		{
+			Batch* batch = _batches;
+			_batches = batch->nextBatch;
+			count = batch->count;
+			return batch;
+		}
+
+		if (_remainSize < kObjectSize)
+		{
+			_memory = (char*)SystemAlloc(kSlabSize);
+			_remainSize = kSlabSize;
+			_totalBytes.fetch_add(kSlabSize, std::memory_order_relaxed);
+		}
+
+		count = (std::uint32_t)(std::min)((std::size_t)kBatchSize, _remainSize / kObjectSize);
+		void* head = _memory;
+		for (std::uint32_t i = 0; i + 1 < count; ++i)
+		{
+			*(void**)_memory = _memory + kObjectSize;
+			_memory += kObjectSize;
+		}
+		*(void**)_memory = nullptr;
+		_memory += kObjectSize;
+		_remainSize -= count * kObjectSize;
+		return head;
+	}
+
+	// 将以nullptr结尾的count个对象放入仓库，由_lock保护
+	// 第一批不满时接在它前面，使未启用本地链表的线程逐个归还时也能凑成整批
+	static void PutBatch(void* head, std::uint32_t count)
+	{
+		Batch* batch = (Batch*)head;
+		if (count == 1 && _batches != nullptr && _batches->count < kBatchSize)
+		{
+			batch->next = _batches;
+			batch->nextBatch = _batches->nextBatch;
+			batch->count = _batches->count + 1;
+		}
+		else
+		{
+			batch->nextBatch = _batches;
+			batch->count = count;
+		}
+		_batches = batch;
+	}
+
+	// 未启用本地链表时申请一个对象
+	static void* PopOne()
+	{
+		std::lock_guard<SpinLock> lk(_lock);
+		std::uint32_t count = 0;
+		void* object = TakeBatch(count);
+		if (count > 1)
+			PutBatch(*(void**)object, count - 1);
+		return object;
+	}
+
+	static inline thread_local Local _local{};
+
+	static inline SpinLock _lock;
+	// 仓库中的各批对象
+	static inline Batch* _batches = nullptr;
+	// 当前内存块中尚未切分的部分
+	static inline char* _memory = nullptr;
+	static inline std::size_t _remainSize = 0;
+	static inline std::atomic<std::size_t> _totalBytes{ 0 };
+};
@@ -1,18 +1,38 @@
 #include "centralCache.h"
 #include "pageCache.h"
 
-CentralCache CentralCache::_ins;
-
-std::size_t CentralCache::FetchRange(void*& begin, void*& end, std::size_t fetchNum, std::size_t index, std::size_t bytes)
+std::size_t CentralCache::FetchRange(void*& begin, void*& end, std::size_t fetchNum, std::size_t index, std::size_t bytes,
+	const void* owner)
 {
-	// 实际获取到的内存数目 = min(freelist.size(), fetchNum);
-	int actualNum = 1;
+	// 整批申请优先从中转缓存中取出，不必操作span
+	// 中转缓存中只有整批，慢启动阶段不足一批的申请直接从span中取，不会多拿
+	if (fetchNum == SizeClass::BatchSize(index))
+	{
+		std::size_t transferNum = _transferCaches[index].Remove(begin, end);
+		if (transferNum > 0)
+			return transferNum;
+	}
 
 	// 相同index下的span会加锁互斥
-	std::unique_lock<std::mutex> lk(_spanLists[index]._mtx);
+	std::unique_lock<CountingMutex> lk(_spanLists[index]._mtx);
 
-	Span* span = _spanLists[index].GetOneSpan();
-	//assert(span && !span->freeList.empty());
+	// _spanLists中的span都有空闲内存块，取第一个即可
+	Span* span = _spanLists[index].empty() ? nullptr : _spanLists[index].front();
+	std::size_t objects = SizeClass::NumOfObjects(index);
+
+	// 不足一批的申请不从中转缓存中取，没有非空的span时先把其中一批还给span，不为此申请新的span
+	if (span == nullptr)
+	{
+		void* batchBegin, * batchEnd;
+		if (_transferCaches[index].Remove(batchBegin, batchEnd) > 0)
+		{
+			// ReleaseToSpans自己加锁
+			lk.unlock();
+			ReleaseToSpans(batchBegin, batchEnd, index);
+			lk.lock();
+			span = _spanLists[index].empty() ? nullptr : _spanLists[index].front();
+		}
+	}
 
 	// 如果没有找到非空的span, 就向page cache获取一个
 	if (span == nullptr)
@@ -21,22 +41,22 @@ std::size_t CentralCache::FetchRange(void*& begin, void*& end, std::size_t fetch
 		lk.unlock();
 
 		PageCache& pageCache = PageCache::GetInstance();
-		span = pageCache.FetchSpan(SizeClass::NumOfMovePage(bytes));
-
-		// 从page cache获取的span需要手动连好自由链表
-		char* begin = (char*)(span->page_id << kPageShift);
-		char* end = begin + (span->page_num << kPageShift);
+		span = pageCache.FetchClassSpan(SizeClass::NumOfPages(index), index);
 
-		std::size_t len = 1;
-		void* cur = begin;
-		while ((char*)cur + bytes < end)
+#ifdef CONCURRENT_POOL_SPAN_BITMAP
+		// 只建立位图，不写入内存块，从未分出的内存块所在的页不会被访问
+		span->bitmap = SpanBitmapPool::New();
+		std::uint64_t* words = span->bitmap->words;
+		for (std::size_t i = 0; i < SpanBitmap::kWords; ++i)
 		{
-			FreeList_next(cur) = (char*)cur + bytes;
-			cur = FreeList_next(cur);
-			++len;
+			std::size_t bits = objects > i * 64 ? (std::min)(objects - i * 64, std::size_t(64)) : 0;
+			words[i] = bits == 64 ? ~std::uint64_t(0) : (std::uint64_t(1) << bits) - 1;
 		}
-		FreeList_next(cur) = nullptr;
-		span->freeList.ReplaceHead(begin, len);
+#else
+		// 不预先连好自由链表，取用时才从首地址依次切出
+		span->free_list = nullptr;
+		span->carved = 0;
+#endif
 
 		// 记录申请对象的大小
 		span->obj_size = bytes;
@@ -46,45 +66,161 @@ std::size_t CentralCache::FetchRange(void*& begin, void*& end, std::size_t fetch
 		_spanLists[index].push_back(span);
 	}
 
-	// 将span->freeList的前fetchNum（或更少）个节点返回
-	end = span->freeList.begin();
-	begin = end;
-	int i = 1;
-	while (FreeList_next(end) != nullptr && i < fetchNum)
+	// 实际获取到的内存数目 = min(空闲内存块数, fetchNum)
+	std::size_t actualNum = (std::min)(fetchNum, objects - span->use_count);
+	assert(actualNum > 0);
+
+#ifdef CONCURRENT_POOL_SPAN_BITMAP
+	// 按地址顺序取出置位的内存块，只有分出的内存块被写入链表
+	char* start = (char*)(span->page_id << kPageShift);
+	std::uint64_t* words = span->bitmap->words;
+	void** link = &begin;
+	std::size_t taken = 0;
+	for (std::size_t i = 0; taken < actualNum; ++i)
 	{
-		++actualNum;
-		++i;
-		end = FreeList_next(end);
+		assert(i < SpanBitmap::kWords);
+		std::uint64_t word = words[i];
+		while (word != 0 && taken < actualNum)
+		{
+			end = start + (i * 64 + CountTrailingZeros(word)) * bytes;
+			word &= word - 1;
+			*link = end;
+			link = &FreeList_next(end);
+			++taken;
+		}
+		words[i] = word;
 	}
+	*link = nullptr;
+#else
+	// 先取归还的内存块，它们已连成链表
+	std::size_t num = 0;
+	begin = end = nullptr;
+	if (span->free_list != nullptr)
+	{
+		begin = end = span->free_list;
+		for (num = 1; num < actualNum && FreeList_next(end) != nullptr; ++num)
+			end = FreeList_next(end);
+		span->free_list = FreeList_next(end);
+	}
+
+	// 不足的部分从未切分的内存按地址顺序切出，只写入分出的内存块
+	if (num < actualNum)
+	{
+		std::size_t carve = actualNum - num;
+		assert(span->carved + carve <= objects);
 
-	// 删除span的freelist的begin到end节点
-	span->freeList.pop_front(end, i);
-	span->use_count += i;
+		char* cur = (char*)(span->page_id << kPageShift) + span->carved * bytes;
+		if (end == nullptr)
+			begin = cur;
+		else
+			FreeList_next(end) = cur;
+
+		for (std::size_t i = 1; i < carve; ++i)
+		{
+			FreeList_next(cur) = cur + bytes;
+			cur += bytes;
+		}
+		end = cur;
+		span->carved += (std::uint32_t)carve;
+	}
 	FreeList_next(end) = nullptr;
+#endif
+
+	span->use_count += (std::uint32_t)actualNum;
+#ifdef CONCURRENT_POOL_REMOTE_FREE
+	span->owner.store(owner, std::memory_order_relaxed);
+#else
+	(void)owner;
+#endif
+
+	// 内存块已全部分出，移入_fullSpanLists
+	if (span->use_count == objects)
+	{
+		_spanLists[index].erase(span);
+		_fullSpanLists[index].push_front(span);
+	}
 
 	return actualNum;
 }
 
+void CentralCache::ReleaseRange(void* begin, void* end, std::size_t num, std::size_t index)
+{
+	std::size_t batch = SizeClass::BatchSize(index);
+	std::size_t maxObjects = kTransferBatches * batch;
+
+	// 按整批切开放入中转缓存，放不下的部分与不足一批的余数归还span
+	while (num >= batch)
+	{
+		void* tail = begin;
+		for (std::size_t i = 1; i < batch; ++i)
+			tail = FreeList_next(tail);
+
+		void* next = FreeList_next(tail);
+		FreeList_next(tail) = nullptr;
+		if (!_transferCaches[index].Insert(begin, tail, batch, maxObjects))
+		{
+			FreeList_next(tail) = next;
+			break;
+		}
+
+		begin = next;
+		num -= batch;
+	}
+
+	if (num > 0)
+		ReleaseToSpans(begin, end, index);
+}
+
+std::size_t CentralCache::ReleaseTransferCaches(bool idleOnly)
+{
+	std::size_t released = 0;
+	for (std::size_t i = 0; i < kNFreeList; ++i)
+	{
+		void* begin, * end;
+		std::size_t num = idleOnly ? _transferCaches[i].Plunder(begin, end) : _transferCaches[i].Flush(begin, end);
+		if (num == 0)
+			continue;
+
+		ReleaseToSpans(begin, end, i);
+		released += num * SizeClass::ClassSize(i);
+	}
+	return released;
+}
+
 void CentralCache::ReleaseToSpans(void* begin, void* end, std::size_t index)
 {
-	std::unique_lock<std::mutex> lk(_spanLists[index]._mtx);
+	std::size_t objects = SizeClass::NumOfObjects(index);
+	std::unique_lock<CountingMutex> lk(_spanLists[index]._mtx);
 	// 依次遍历所有节点
 	void* cur = begin;
 	while (cur != nullptr)
 	{
-		// 先保存下一个节点，防止span->freeList.push_front(cur)后无法找到
+		// 先保存下一个节点，防止放入span后无法找到
 		void* next = FreeList_next(cur);
 
 		// 找到对应页号
 		std::size_t id = (std::size_t)cur >> kPageShift;
 		// 通过映射找到span
-		//PageCache& pageCache = PageCache::GetInstance();
-		//pageCache._pageMtx.lock();
 		Span* span = PageCache::_idSpanMap.get(id);
-		//pageCache._pageMtx.unlock();
+
+		// span重新有了空闲内存块，从_fullSpanLists移回_spanLists
+		if (span->use_count == objects)
+		{
+			_fullSpanLists[index].erase(span);
+			_spanLists[index].push_front(span);
+		}
 
 		// 将当前节点放入对应span
-		span->freeList.push_front(cur);
+#ifdef CONCURRENT_POOL_SPAN_BITMAP
+		// 由地址算出序号后置位，不写入内存块
+		std::size_t slot = SizeClass::SlotOf(index, (char*)cur - (char*)(span->page_id << kPageShift));
+		std::uint64_t bit = std::uint64_t(1) << (slot % 64);
+		assert((span->bitmap->words[slot / 64] & bit) == 0);
+		span->bitmap->words[slot / 64] |= bit;
+#else
+		FreeList_next(cur) = span->free_list;
+		span->free_list = cur;
+#endif
 
 		// 如果span的被使用次数减为0，就向pagecache归还span
 		if (--span->use_count == 0)
@@ -93,6 +229,9 @@ void CentralCache::ReleaseToSpans(void* begin, void* end, std::size_t index)
 			_spanLists[index].erase(span);
 
 			lk.unlock();
+#ifdef CONCURRENT_POOL_SPAN_BITMAP
+			SpanBitmapPool::Delete(span->bitmap);
+#endif
 			PageCache& pageCache = PageCache::GetInstance();
 			pageCache.ReleaseSpanToPageCache(span);
 			lk.lock();
@@ -101,3 +240,85 @@ void CentralCache::ReleaseToSpans(void* begin, void* end, std::size_t index)
 		cur = next;
 	}
 }
+
+#ifdef CONCURRENT_POOL_REMOTE_FREE
+void CentralCache::RemoteFree(Span* span, void* ptr, std::size_t index)
+{
+	void* head = span->remote_list.load(std::memory_order_relaxed);
+	do
+	{
+		FreeList_next(ptr) = head;
+	} while (!span->remote_list.compare_exchange_weak(head, ptr, std::memory_order_acq_rel, std::memory_order_relaxed));
+
+	// 链表原本非空时span已在栈中，或正被回收的线程取走，之后会被整条取走
+	if (head != nullptr)
+		return;
+
+	// span中至少有ptr未归还，在放入栈之前不会被回收或释放
+	Span* top = _remoteSpans[index].load(std::memory_order_relaxed);
+	do
+	{
+		span->remote_next = top;
+	} while (!_remoteSpans[index].compare_exchange_weak(top, span, std::memory_order_release, std::memory_order_relaxed));
+}
+
+std::size_t CentralCache::ReclaimRemote(void*& begin, void*& end, std::size_t index)
+{
+	if (_remoteSpans[index].load(std::memory_order_relaxed) == nullptr)
+		return 0;
+
+	// 整个栈一次取走，没有ABA问题
+	Span* span = _remoteSpans[index].exchange(nullptr, std::memory_order_acquire);
+
+	std::size_t num = 0;
+	begin = end = nullptr;
+	while (span != nullptr)
+	{
+		// 取走链表后其他线程可能立即把span重新入栈，须先读出remote_next
+		// acq_rel保证这次读取先于下一个使链表由空变为非空的线程改写remote_next
+		Span* next = span->remote_next;
+		void* head = span->remote_list.exchange(nullptr, std::memory_order_acq_rel);
+
+		void* tail = head;
+		++num;
+		while (FreeList_next(tail) != nullptr)
+		{
+			tail = FreeList_next(tail);
+			++num;
+		}
+
+		FreeList_next(tail) = begin;
+		begin = head;
+		if (end == nullptr)
+			end = tail;
+
+		span = next;
+	}
+	return num;
+}
+#endif
+
+void CentralCache::CollectStats(PoolStats& stats)
+{
+	for (std::size_t i = 0; i < kNFreeList; ++i)
+	{
+		ClassStats& cls = stats.classes[i];
+		cls.size = SizeClass::ClassSize(i);
+		cls.transfer_cache_bytes += _transferCaches[i].Objects() * cls.size;
+
+		// 先读锁的计数，不计入本次统计自身的加锁
+		cls.lock_acquisitions += _spanLists[i]._mtx.Acquisitions();
+		cls.lock_contentions += _spanLists[i]._mtx.Contentions();
+
+		std::unique_lock<CountingMutex> lk(_spanLists[i]._mtx);
+		for (SpanList* list : { &_spanLists[i], &_fullSpanLists[i] })
+		{
+			for (Span* span = list->begin(); span != list->end(); span = span->next)
+			{
+				++cls.span_count;
+				cls.span_bytes += span->page_num << kPageShift;
+				cls.central_cache_bytes += (SizeClass::NumOfObjects(i) - span->use_count) * cls.size;
+			}
+		}
+	}
+}
@@ -1,7 +1,110 @@
 #pragma once
+#include <new>
+
 #include "common.h"
+#include "stats.h"
+
+// 中转缓存，按桶存放thread cache归还的整批内存，每批正好是该桶一次移动的数量
+// thread cache整批申请和归还时优先与它交换，只有它为空或已满时才需操作span
+class TransferCache
+{
+	// 最多缓存的批数
+	static constexpr std::size_t kMaxBatches = 64;
+
+	// 一批内存的头尾及数量
+	struct Batch
+	{
+		void* begin;
+		void* end;
+		std::size_t num;
+	};
+
+public:
+	// 取出最近放入的一批，为空时返回0
+	std::size_t Remove(void*& begin, void*& end)
+	{
+		std::lock_guard<SpinLock> lk(_lock);
+		if (_size == 0)
+			return 0;
+
+		Batch& batch = _batches[--_size];
+		begin = batch.begin;
+		end = batch.end;
+		_objects -= batch.num;
+		_lowWater = (std::min)(_lowWater, _size);
+		return batch.num;
+	}
+
+	// 放入一批，已满时返回false
+	// maxObjects: 该桶最多缓存的内存块数量
+	bool Insert(void* begin, void* end, std::size_t num, std::size_t maxObjects)
+	{
+		std::lock_guard<SpinLock> lk(_lock);
+		if (_size == kMaxBatches || _objects + num > maxObjects)
+			return false;
+
+		_batches[_size++] = { begin, end, num };
+		_objects += num;
+		return true;
+	}
+
+	// 取出所有批，连成begin到end，返回内存块数量，为空时返回0
+	std::size_t Flush(void*& begin, void*& end)
+	{
+		std::lock_guard<SpinLock> lk(_lock);
+		return TakeOldest(_size, begin, end);
+	}
+
+	// 取出上次调用以来一直没有被取用的批，即栈底低水位以下的批，返回内存块数量
+	std::size_t Plunder(void*& begin, void*& end)
+	{
+		std::lock_guard<SpinLock> lk(_lock);
+		std::size_t num = TakeOldest(_lowWater, begin, end);
+		_lowWater = _size;
+		return num;
+	}
+
+	// 缓存的内存块数量
+	std::size_t Objects()
+	{
+		std::lock_guard<SpinLock> lk(_lock);
+		return _objects;
+	}
+
+private:
+	// 取出栈底的n批连成一条链表，其余的批下移，需持有_lock
+	std::size_t TakeOldest(std::size_t n, void*& begin, void*& end)
+	{
+		std::size_t num = 0;
+		begin = end = nullptr;
+		for (std::size_t i = 0; i < n; ++i)
+		{
+			if (end == nullptr)
+				begin = _batches[i].begin;
+			else
+				FreeList_next(end) = _batches[i].begin;
+			end = _batches[i].end;
+			num += _batches[i].num;
+		}
+
+		std::copy(_batches + n, _batches + _size, _batches);
+		_size -= n;
+		_objects -= num;
+		_lowWater = (std::min)(_lowWater, _size);
+		return num;
+	}
+
+	SpinLock _lock;
+	std::size_t _size = 0;
+	std::size_t _objects = 0;
+	// 上次Plunder以来_size的最小值，栈底这么多批期间没有被取用
+	std::size_t _lowWater = 0;
+	Batch _batches[kMaxBatches];
+};
 
-// 单例模式-饿汉
+// 单例模式-懒汉
+// span默认用写在空闲内存块中的链表记录空闲内存块
+// 定义CONCURRENT_POOL_SPAN_BITMAP时改用每个对象一位的位图，切分span与归还内存块都不写入内存块
 class CentralCache
 {
 public:
@@ -9,22 +112,58 @@ public:
 	CentralCache(const CentralCache&) = delete;
 
 	//	返回实例
+	// 首次使用时构造在静态存储上且从不析构，main之前或退出时申请内存都是安全的
 	static CentralCache& GetInstance()
 	{
-		return _ins;
+		alignas(CentralCache) static char storage[sizeof(CentralCache)];
+		static CentralCache* ins = new (storage) CentralCache;
+		return *ins;
 	}
 
 	// 给予thread cache内存
 	// begin, end: 输出参数	   fetchNum: 申请的空间数量    index: 对应桶下标
-	std::size_t FetchRange(void*& begin, void*& end, std::size_t fetchNum, std::size_t index, std::size_t bytes);
+	// owner: 申请的thread cache，定义CONCURRENT_POOL_REMOTE_FREE时记录为span的持有者
+	std::size_t FetchRange(void*& begin, void*& end, std::size_t fetchNum, std::size_t index, std::size_t bytes,
+		const void* owner = nullptr);
+
+	// 归还begin到end的num个内存块，优先放入中转缓存，已满时再归还给span
+	void ReleaseRange(void* begin, void* end, std::size_t num, std::size_t index);
 
 	// 把begin到end归还给其对应的span
 	void ReleaseToSpans(void* begin, void* end, std::size_t index);
 
+	// 把各桶中转缓存中的批归还给span，span全部空闲时随之归还page cache，返回归还的字节数
+	// idleOnly为true时只归还上次调用以来一直没有被取用的批，否则全部归还
+	std::size_t ReleaseTransferCaches(bool idleOnly);
+
+	// 将每个桶缓存的字节数与持有的span累加到stats中，逐个桶加锁
+	void CollectStats(PoolStats& stats);
+
+#ifdef CONCURRENT_POOL_REMOTE_FREE
+	// 非持有者释放ptr时调用，用一次CAS头插到span的远程释放链表，不加锁
+	// 使链表由空变为非空的线程负责把span放入该桶的待回收栈
+	void RemoteFree(Span* span, void* ptr, std::size_t index);
+
+	// 取走该桶所有待回收span的远程释放链表，连成begin到end，返回内存块数量，不加锁
+	// 取走的内存块仍计入各span的use_count，与thread cache中缓存的内存块相同
+	std::size_t ReclaimRemote(void*& begin, void*& end, std::size_t index);
+#endif
+
 private:
 	CentralCache() {};
 
+	// 每个桶中转缓存最多缓存的批数(按该桶一次移动的数量计)
+	static constexpr std::size_t kTransferBatches = 8;
+
 	// 桶的大小和kNFreeList相同
+	// _spanLists中只存放还有空闲内存块的span，内存块全部分出去的span放入_fullSpanLists
+	// 两者都由_spanLists[index]._mtx保护
 	SpanList _spanLists[kNFreeList];
-	static CentralCache _ins;
+	SpanList _fullSpanLists[kNFreeList];
+	TransferCache _transferCaches[kNFreeList];
+
+#ifdef CONCURRENT_POOL_REMOTE_FREE
+	// 每个桶中远程释放链表非空的span组成的栈，经remote_next相连
+	std::atomic<Span*> _remoteSpans[kNFreeList] = {};
+#endif
 };
\ No newline at end of file
@@ -1,13 +1,20 @@
 #pragma once
 #include <cstring>
+#include <cstdint>
 
 #include <iostream>
 #include <cassert>
 #include <mutex>
+#include <atomic>
+#include <thread>
 #include <algorithm>
 
 #include <unordered_map>
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 #include "alloc.h"
 using std::cout;
 using std::endl;
@@ -122,49 +129,170 @@ public:
 	}
 };
 
-// 自由链表桶大小
-static const std::size_t kNFreeList = 184;
+// 返回x二进制末尾0的个数，x不能为0
+static inline std::size_t CountTrailingZeros(std::uint64_t x)
+{
+	assert(x != 0);
+#ifdef _MSC_VER
+	unsigned long index = 0;
+	_BitScanForward64(&index, x);
+	return index;
+#else
+	return __builtin_ctzll(x);
+#endif
+}
 
-// page cache中spanlist的大小
-static const std::size_t kNPageList = 128 + 1;
+// 统计加锁次数与等待次数的互斥锁，用于观察central cache与page cache的锁竞争
+// 计数只在持有锁时修改，不需要原子加；try_lock失败时不计数
+class CountingMutex
+{
+public:
+	void lock()
+	{
+#ifndef CONCURRENT_POOL_NO_STATS
+		if (!_mtx.try_lock())
+		{
+			_mtx.lock();
+			Increase(_contentions);
+		}
+		Increase(_acquisitions);
+#else
+		_mtx.lock();
+#endif
+	}
+
+	bool try_lock()
+	{
+		if (!_mtx.try_lock())
+			return false;
+#ifndef CONCURRENT_POOL_NO_STATS
+		Increase(_acquisitions);
+#endif
+		return true;
+	}
+
+	void unlock()
+	{
+		_mtx.unlock();
+	}
+
+	// 累计加锁次数，以及其中需要等待的次数
+	std::uint64_t Acquisitions() const
+	{
+		return _acquisitions.load(std::memory_order_relaxed);
+	}
+
+	std::uint64_t Contentions() const
+	{
+		return _contentions.load(std::memory_order_relaxed);
+	}
+
+private:
+	static void Increase(std::atomic<std::uint64_t>& counter)
+	{
+		counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+
+	std::mutex _mtx;
+	std::atomic<std::uint64_t> _acquisitions{ 0 };
+	std::atomic<std::uint64_t> _contentions{ 0 };
+};
 
 // page大小对应的2的次方
 static const std::size_t kPageShift = 13;
 
+// 透明大页大小对应的2的次方
+static const std::size_t kHugePageShift = 21;
+
+// page cache中spanlist的大小
+// 定义CONCURRENT_POOL_HUGEPAGE时page cache以2M对齐的大页为单位增长，最大的span正好是一个大页
+#ifdef CONCURRENT_POOL_HUGEPAGE
+static const std::size_t kNPageList = (1 << (kHugePageShift - kPageShift)) + 1;
+#else
+static const std::size_t kNPageList = 128 + 1;
+#endif
+
 // 可在三层缓存中执行申请释放操作的最大内存
 static const std::size_t kMaxBytes = 64 * 1024;
 
+// 对齐规则: 区间上界与该区间的对齐数
+// 控制在1%-12%左右的内碎片浪费
+// [1,128]					8byte对齐	     freelist[0,16)
+// [129,1024]				16byte对齐		 freelist[16,72)
+// [1025,8*1024]			128byte对齐	     freelist[72,128)
+// [8*1024+1,64*1024]		1024byte对齐     freelist[128,184)
+struct AlignRule
+{
+	std::size_t max_bytes;
+	std::size_t align;
+};
+
+static constexpr AlignRule kAlignRules[] = {
+	{ 128, 8 },
+	{ 1024, 16 },
+	{ 8 * 1024, 128 },
+	{ 64 * 1024, 1024 },
+};
+
+// 按对齐规则计算自由链表桶的数量
+constexpr std::size_t NumOfSizeClasses()
+{
+	std::size_t num = 0, lower = 0;
+	for (const AlignRule& rule : kAlignRules)
+	{
+		num += (rule.max_bytes - lower) / rule.align;
+		lower = rule.max_bytes;
+	}
+	return num;
+}
+
+// 自由链表桶大小
+static constexpr std::size_t kNFreeList = NumOfSizeClasses();
+
 
 // 管理对齐和映射等关系
+// 所有映射关系在编译期生成表，申请释放时只需一到两次查表
 class SizeClass
 {
 public:
-	// 控制在1%-12%左右的内碎片浪费
-	// [1,128]					8byte对齐	     freelist[0,16)
-	// [129,1024]				16byte对齐		 freelist[16,72)
-	// [1025,8*1024]			128byte对齐	     freelist[72,128)
-	// [8*1024+1,64*1024]		1024byte对齐     freelist[128,184)
+	// [1,1024]按8byte粒度查表，(1024,kMaxBytes]按128byte粒度查表
+	static constexpr std::size_t kSmallMax = 1024;
+	static constexpr std::size_t kSmallShift = 3;
+	static constexpr std::size_t kLargeShift = 7;
+	// 计算对象序号时的定点精度，span内偏移乘以reciprocal不会溢出
+	static constexpr std::size_t kSlotShift = 40;
+
+	// 每个自由链表桶的参数
+	struct ClassInfo
+	{
+		// 对象大小
+		std::size_t size;
+		// 一次可从central cache中获取的内存块的数量
+		std::size_t batch;
+		// central cache一次向page cache申请的页数
+		std::size_t pages;
+		// 一个span能切出的对象数量
+		std::size_t objects;
+		// ceil(2^kSlotShift / size)，用乘法和移位代替除法计算对象在span中的序号
+		std::uint64_t reciprocal;
+	};
+
+	// 编译期生成的映射表
+	struct Map
+	{
+		unsigned char small_class[(kSmallMax >> kSmallShift) + 1];
+		unsigned char large_class[(kMaxBytes >> kLargeShift) + 1];
+		ClassInfo info[kNFreeList];
+	};
 
 	// 返回对齐后的大小
 	static std::size_t RoundUp(std::size_t size)
 	{
 		assert(size > 0);
-		
-		if (size <= 128)
-		{
-			return _RoundUp(size, 8);
-		}
-		else if (size <= 1024)
-		{
-			return  _RoundUp(size, 16);
-		}
-		else if (size <= 8 * 1024)
-		{
-			return  _RoundUp(size, 128);
-		}
-		else if (size <= 64 * 1024)
+
+		if (size <= kMaxBytes)
 		{
-			return  _RoundUp(size, 1024);
+			return kMap.info[Index(size)].size;
 		}
 		else
 		{
@@ -177,34 +305,82 @@ public:
 	{
 		assert(size <= kMaxBytes && size > 0);
 
-		if (size <= 128)
-		{
-			return _Index(size, 3);
-		}
-		else if (size <= 1024)
+		if (size <= kSmallMax)
 		{
-			return  _Index(size - 128, 4) + 16;
+			return kMap.small_class[(size + (1 << kSmallShift) - 1) >> kSmallShift];
 		}
-		else if (size <= 8 * 1024)
-		{
-			return  _Index(size - 1024, 7) + 72;
-		}
-		else if (size <= 64 * 1024)
+		else
 		{
-			return  _Index(size - 1024 * 8, 10) + 128;
+			return kMap.large_class[(size + (1 << kLargeShift) - 1) >> kLargeShift];
 		}
-		else
+	}
+
+	// 按align字节对齐申请size字节时使用的桶下标，align为2的次方
+	// span首地址按页对齐，对象从首地址依次排列，因此大小为align倍数的桶中每个对象都按align对齐
+	// 不存在这样的桶(align大于一页或对齐后超过kMaxBytes)时返回kNFreeList
+	static std::size_t AlignedIndex(std::size_t size, std::size_t align)
+	{
+		assert(align > 0 && (align & (align - 1)) == 0);
+
+		if (size == 0)
+			size = 1;
+		if (align > (std::size_t(1) << kPageShift) || size > kMaxBytes)
+			return kNFreeList;
+
+		// 先按align取整，现有对齐规则下取整后的大小通常恰好就是一个桶
+		size = (size + align - 1) & ~(align - 1);
+		if (size > kMaxBytes)
+			return kNFreeList;
+
+		for (std::size_t i = Index(size); i < kNFreeList; ++i)
 		{
-			assert(false);
-			return 0;
+			if ((kMap.info[i].size & (align - 1)) == 0)
+				return i;
 		}
+		return kNFreeList;
+	}
+
+	// 下标对应的对象大小
+	static std::size_t ClassSize(std::size_t index)
+	{
+		assert(index < kNFreeList);
+		return kMap.info[index].size;
+	}
+
+	// 下标对应的可从central cache中获取的内存块的数量
+	static std::size_t BatchSize(std::size_t index)
+	{
+		assert(index < kNFreeList);
+		return kMap.info[index].batch;
+	}
+
+	// 下标对应的span页数
+	static std::size_t NumOfPages(std::size_t index)
+	{
+		assert(index < kNFreeList);
+		return kMap.info[index].pages;
+	}
+
+	// 下标对应的一个span中的对象数量
+	static std::size_t NumOfObjects(std::size_t index)
+	{
+		assert(index < kNFreeList);
+		return kMap.info[index].objects;
+	}
+
+	// 距span首地址offset字节的对象的序号，offset须为对象大小的整数倍
+	static std::size_t SlotOf(std::size_t index, std::size_t offset)
+	{
+		assert(index < kNFreeList);
+		return (offset * kMap.info[index].reciprocal) >> kSlotShift;
 	}
 
 	// 一次向系统申请的页数
-	static std::size_t NumOfMovePage(std::size_t bytes)
+	static constexpr std::size_t NumOfMovePage(std::size_t bytes)
 	{
 		std::size_t moveSize = NumOfMoveSize(bytes);
-		std::size_t pages = (moveSize * bytes) >> kPageShift;
+		// 向上取整，保证span至少能放下moveSize个对象
+		std::size_t pages = (moveSize * bytes + (1 << kPageShift) - 1) >> kPageShift;
 
 		if (pages == 0)
 			pages = 1;
@@ -213,7 +389,7 @@ public:
 	}
 
 	// 可从central cache中获取的内存块的数量
-	static std::size_t NumOfMoveSize(std::size_t bytes)
+	static constexpr std::size_t NumOfMoveSize(std::size_t bytes)
 	{
 		if (bytes == 0)
 			return 0;
@@ -229,23 +405,138 @@ public:
 		return num;
 	}
 
+	// 生成映射表
+	static constexpr Map Generate()
+	{
+		Map map{};
+		std::size_t index = 0, lower = 0;
+		for (const AlignRule& rule : kAlignRules)
+		{
+			for (std::size_t size = lower + rule.align; size <= rule.max_bytes; size += rule.align)
+			{
+				std::size_t pages = NumOfMovePage(size);
+				map.info[index] = { size, NumOfMoveSize(size), pages, (pages << kPageShift) / size,
+					((std::uint64_t(1) << kSlotShift) + size - 1) / size };
+				++index;
+			}
+			lower = rule.max_bytes;
+		}
 
-private:
+		// 每个查表粒度上的大小映射到不小于它的第一个桶
+		index = 0;
+		for (std::size_t i = 1; i <= (kSmallMax >> kSmallShift); ++i)
+		{
+			while (map.info[index].size < (i << kSmallShift))
+				++index;
+			map.small_class[i] = (unsigned char)index;
+		}
+
+		index = 0;
+		for (std::size_t i = 1; i <= (kMaxBytes >> kLargeShift); ++i)
+		{
+			while (map.info[index].size < (i << kLargeShift))
+				++index;
+			map.large_class[i] = (unsigned char)index;
+		}
+
+		return map;
+	}
+
+	// 检查每个桶的内碎片浪费
+	// 128byte以内浪费不超过对齐数，其余桶的浪费比例不超过12%
+	static constexpr bool CheckWaste(const Map& map)
+	{
+		std::size_t prev = 0;
+		for (std::size_t i = 0; i < kNFreeList; ++i)
+		{
+			std::size_t size = map.info[i].size;
+			std::size_t waste = size - (prev + 1);
+			if (size <= 128 ? waste >= 8 : waste * 100 > size * 12)
+				return false;
 
-	static std::size_t _Index(std::size_t size, int align_shift)
+			prev = size;
+		}
+		return true;
+	}
+
+	// 检查查表结果与逐字节计算的结果一致
+	static constexpr bool CheckLookup(const Map& map)
 	{
-		//return ((size + (1 << align_shift) - 1) >> align_shift) - 1;
-		return (size - 1) >> align_shift;
+		std::size_t index = 0;
+		for (std::size_t size = 1; size <= kMaxBytes; ++size)
+		{
+			if (size > map.info[index].size)
+				++index;
+
+			std::size_t looked = size <= kSmallMax
+				? map.small_class[(size + (1 << kSmallShift) - 1) >> kSmallShift]
+				: map.large_class[(size + (1 << kLargeShift) - 1) >> kLargeShift];
+			if (looked != index)
+				return false;
+		}
+		return true;
 	}
 
+	// 检查每个对象的序号都能由reciprocal精确算出
+	static constexpr bool CheckSlot(const Map& map)
+	{
+		for (std::size_t i = 0; i < kNFreeList; ++i)
+		{
+			const ClassInfo& info = map.info[i];
+			for (std::size_t slot = 0; slot < info.objects; ++slot)
+			{
+				if (((slot * info.size * info.reciprocal) >> kSlotShift) != slot)
+					return false;
+			}
+		}
+		return true;
+	}
+
+	// 所有桶中一个span的最大对象数量
+	static constexpr std::size_t MaxObjects(const Map& map)
+	{
+		std::size_t max = 0;
+		for (const ClassInfo& info : map.info)
+			max = (std::max)(max, info.objects);
+		return max;
+	}
+
+	static const Map kMap;
+
+private:
 	static std::size_t _RoundUp(std::size_t size, int align)
 	{
 		return (size + align - 1) & ~(align - 1);
 	}
 };
 
+inline constexpr SizeClass::Map SizeClass::kMap = SizeClass::Generate();
+
+static_assert(kNFreeList == 184, "free list layout changed");
+static_assert(kNFreeList <= 256, "class index must fit in unsigned char");
+static_assert(SizeClass::CheckWaste(SizeClass::kMap), "size class waste exceeds bound");
+static_assert(SizeClass::CheckLookup(SizeClass::kMap), "size class lookup table is inconsistent");
+static_assert(SizeClass::CheckSlot(SizeClass::kMap), "size class reciprocal is inexact");
+
+// 一个span最多能切出的对象数量
+static constexpr std::size_t kMaxSpanObjects = SizeClass::MaxObjects(SizeClass::kMap);
+
+#ifdef CONCURRENT_POOL_SPAN_BITMAP
+// span中每个对象一位，1表示空闲，由central cache在切分span时建立
+struct SpanBitmap
+{
+	static constexpr std::size_t kWords = (kMaxSpanObjects + 63) / 64;
+
+	std::uint64_t words[kWords];
+};
+
+// 位图的定长内存池
+using SpanBitmapPool = ConcurrentObjectPool<SpanBitmap>;
+#endif
+
 // 管理一个跨度的大块内存
-struct Span
+// 按缓存行对齐且不超过一个缓存行，central cache与page cache加锁后的操作只读写一行
+struct alignas(64) Span
 {
 	// 最小的页号
 	std::size_t page_id = 0;
@@ -255,43 +546,69 @@ struct Span
 	Span* next = nullptr;
 	Span* prev = nullptr;
 
-	FreeList freeList;
-	// freeList的使用次数
-	std::size_t use_count = 0;
-	//  当span被central cache获取即视为被使用
-	bool is_used = false;
-
 	// 当前span对应内存所存储的对象的大小
 	std::size_t obj_size = 0;
+
+	// span被central cache持有时记录空闲内存块，空闲时记录进入page cache的时间，两者不会同时使用
+	union
+	{
+#ifdef CONCURRENT_POOL_SPAN_BITMAP
+		// 空闲内存块的位图，释放时只置位，不写入内存块
+		SpanBitmap* bitmap = nullptr;
+#else
+		// 归还的内存块的链表头，未切出的内存块不在链表中
+		void* free_list = nullptr;
+#endif
+		// 进入page cache空闲链表的时间(毫秒)
+		std::uint64_t free_time;
+	};
+
+	// 分出的内存块数量，包括缓存在thread cache与中转缓存中的
+	std::uint32_t use_count = 0;
+#ifndef CONCURRENT_POOL_SPAN_BITMAP
+	// 已从span首地址起依次切出的内存块数量，其后的内存未被写入过
+	std::uint32_t carved = 0;
+#endif
+	//  当span被central cache获取即视为被使用
+	bool is_used = false;
+	// 空闲span的物理内存已归还系统，再次使用时按需重新提交
+	bool is_returned = false;
+
+#ifdef CONCURRENT_POOL_REMOTE_FREE
+	// 最近从该span取走内存块的thread cache，只用于比较，不解引用
+	std::atomic<const void*> owner{ nullptr };
+	// 其他线程释放的内存块，释放时CAS头插，回收时整条取走
+	std::atomic<void*> remote_list{ nullptr };
+	// central cache待回收栈中的下一个span
+	Span* remote_next = nullptr;
+#endif
 };
 
-// 定长内存池，用于代替new
-static ObjectPool<Span> spanPool;
+// 定义CONCURRENT_POOL_REMOTE_FREE时远程释放的字段占用第二个缓存行
+#ifdef CONCURRENT_POOL_REMOTE_FREE
+static_assert(sizeof(Span) == 128, "Span must fit in two cache lines");
+#else
+static_assert(sizeof(Span) == 64, "Span must fit in one cache line");
+#endif
+
+// Span的定长内存池，用于代替new，所有编译单元共用
+using SpanPool = ConcurrentObjectPool<Span>;
 
 // 双向循环带头链表
 class SpanList
 {
 public:
 	SpanList()
-		: _head(spanPool.New())
+		: _head(SpanPool::New())
 	{
 		_head->next = _head;
 		_head->prev = _head;
 	}
 
-	// 获取一个非空的span
-	Span* GetOneSpan() const
+	Span* front() const
 	{
-		Span* cur = _head->next;
-		while (cur != _head)
-		{
-			if (!cur->freeList.empty())
-				return cur;
-
-			cur = cur->next;
-		}
-
-		return nullptr;
+		assert(!empty());
+		return _head->next;
 	}
 
 	void push_front(Span* inNode)
@@ -340,10 +657,21 @@ public:
 		return _head->next == _head;
 	}
 
+	// 遍历用，[begin(), end())
+	Span* begin() const
+	{
+		return _head->next;
+	}
+
+	Span* end() const
+	{
+		return _head;
+	}
+
 private:
 	Span* _head;
 
 public:
 	// 当多个线程向桶的同一个SpanList申请内存时, 需要加锁
-	std::mutex _mtx;
+	CountingMutex _mtx;
 };
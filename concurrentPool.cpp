@@ -0,0 +1,389 @@
+#include "concurrentPool.h"
+
+// ThreadCache只在线程创建和退出时申请释放各一次，不启用本地链表，避免每个线程多占几个ThreadCache
+using ThreadCachePool = ConcurrentObjectPool<ThreadCache>;
+
+#ifndef CONCURRENT_POOL_NO_STATS
+// 大对象的申请释放本身需要加锁，直接使用原子计数
+static std::atomic<std::uint64_t> largeAllocCount{ 0 };
+static std::atomic<std::uint64_t> largeFreeCount{ 0 };
+#endif
+
+// 线程的thread cache已回收，之后的申请释放直接经过central cache
+// glibc在TLS析构之后仍会释放内存(例如析构函数链表的节点)，不能再创建thread cache，否则无人回收
+#ifdef _WIN32
+static __declspec(thread) bool tlsThreadExiting = false;
+#else
+static __thread bool tlsThreadExiting = false;
+#endif
+
+// 线程退出时析构，将thread cache中的内存归还central cache并回收thread cache
+// 归还后空闲的span会继续归还page cache合并
+struct ThreadCacheReleaser
+{
+	~ThreadCacheReleaser()
+	{
+		tlsThreadExiting = true;
+		ThreadCache* tc = pTLS_threadCache;
+		if (tc == nullptr)
+			return;
+
+		pTLS_threadCache = nullptr;
+		tc->ReleaseAll();
+		ThreadCache::Unregister(tc);
+		ThreadCachePool::Delete(tc);
+	}
+};
+
+// 返回当前线程的thread cache，首次使用时创建，线程正在退出时返回nullptr
+static ThreadCache* GetThreadCache()
+{
+	if (pTLS_threadCache == nullptr)
+	{
+		if (tlsThreadExiting)
+			return nullptr;
+
+		ThreadCache* tc = ThreadCachePool::New();
+		ThreadCache::Register(tc);
+
+		pTLS_threadCache = tc;
+
+		// Span只在持有page cache的锁时申请释放，须在此处启用本地链表
+		// 先于releaser注册，线程退出时在ReleaseAll之后才归还
+		SpanPool::AttachThread();
+
+		// 首次经过时注册线程退出时的析构
+		static thread_local ThreadCacheReleaser releaser;
+		(void)releaser;
+	}
+
+	return pTLS_threadCache;
+}
+
+// 每个线程最近释放过的页号到桶下标的直接映射缓存，命中时不必读取_idClassMap
+// 条目为(页号 << 8) | (桶下标 + 1)，0表示空；_classEpoch变化时整体清空
+static constexpr std::size_t kClassCacheSize = 64;
+#ifdef _WIN32
+static __declspec(thread) std::uint64_t tlsClassCache[kClassCacheSize];
+static __declspec(thread) std::uint64_t tlsClassEpoch = 0;
+#else
+static __thread std::uint64_t tlsClassCache[kClassCacheSize];
+static __thread std::uint64_t tlsClassEpoch = 0;
+#endif
+
+// 返回第id页所属的桶下标，不属于central cache中的span时返回kNFreeList
+// 释放的对象仍存活，它所在页的映射在申请前建立，span归还前不会清除，因此不需要加锁
+static std::size_t LookupClass(std::size_t id)
+{
+	// 映射被清除后，先于此次释放发生的自增一定可见
+	std::uint64_t epoch = PageCache::_classEpoch.load(std::memory_order_acquire);
+	if (epoch != tlsClassEpoch)
+	{
+		memset(tlsClassCache, 0, sizeof(tlsClassCache));
+		tlsClassEpoch = epoch;
+	}
+
+	std::uint64_t& entry = tlsClassCache[id & (kClassCacheSize - 1)];
+	if ((entry >> 8) == id)
+		return (std::size_t)(entry & 0xff) - 1;
+
+	unsigned char cls = PageCache::_idClassMap.get(id);
+	if (cls == 0)
+		return kNFreeList;
+	entry = ((std::uint64_t)id << 8) | cls;
+	return (std::size_t)cls - 1;
+}
+
+// 小对象从当前CPU或当前线程的缓存中申请
+static void* AllocateFromCache(std::size_t bytes)
+{
+#ifdef CONCURRENT_POOL_PER_CPU
+	if (CpuCache::Enabled())
+		return CpuCache::GetInstance().Allocate(bytes);
+#endif
+	ThreadCache* tc = GetThreadCache();
+	if (tc != nullptr)
+		return tc->Allocate(bytes);
+
+	// 线程退出后逐个从central cache取
+	std::size_t index = SizeClass::Index(bytes == 0 ? 1 : bytes);
+	void* begin = nullptr, * end = nullptr;
+	CentralCache::GetInstance().FetchRange(begin, end, 1, index, SizeClass::ClassSize(index), nullptr);
+	return begin;
+}
+
+// 小对象归还到当前CPU或当前线程的缓存
+static void DeallocateToCache(void* ptr, std::size_t bytes)
+{
+#ifdef CONCURRENT_POOL_PER_CPU
+	if (CpuCache::Enabled())
+	{
+		CpuCache::GetInstance().Deallocate(ptr, bytes);
+		return;
+	}
+#endif
+	ThreadCache* tc = GetThreadCache();
+	if (tc != nullptr)
+	{
+		tc->Deallocate(ptr, bytes);
+		return;
+	}
+
+	// 线程退出后直接归还span
+	FreeList_next(ptr) = nullptr;
+	CentralCache::GetInstance().ReleaseRange(ptr, ptr, 1, SizeClass::Index(bytes == 0 ? 1 : bytes));
+}
+
+void* ConcurrentAlloc(std::size_t bytes)
+{
+	void* ptr = nullptr;
+	// 若大于kMaxBytes，直接向pageCache获取内存
+	if (bytes > kMaxBytes)
+	{
+		std::size_t realBytes = SizeClass::RoundUp(bytes);
+		PageCache& pageCache = PageCache::GetInstance();
+
+		// 记录大小
+		Span* span = pageCache.FetchSpan(realBytes >> kPageShift);
+		span->obj_size = realBytes;
+#ifndef CONCURRENT_POOL_NO_STATS
+		largeAllocCount.fetch_add(1, std::memory_order_relaxed);
+#endif
+		ptr = (void*)((std::size_t)span->page_id << kPageShift);
+	}
+	else
+	{
+		ptr = AllocateFromCache(bytes);
+	}
+
+	if (HeapProfiler::Tick(bytes))
+		HeapProfiler::GetInstance().RecordSample(ptr, bytes);
+	return ptr;
+}
+
+void* ConcurrentAlignedAlloc(std::size_t bytes, std::size_t align)
+{
+	std::size_t index = SizeClass::AlignedIndex(bytes, align);
+	if (index < kNFreeList)
+	{
+		void* ptr = AllocateFromCache(SizeClass::ClassSize(index));
+		if (HeapProfiler::Tick(bytes))
+			HeapProfiler::GetInstance().RecordSample(ptr, bytes);
+		return ptr;
+	}
+
+	// 没有合适的桶，由page cache切出按align对齐的span
+	// 大小至少为kMaxBytes + 1，使释放时能按大对象归还page cache
+	std::size_t realBytes = SizeClass::RoundUp((std::max)(bytes, kMaxBytes + 1));
+	std::size_t alignPages = (std::max)(align >> kPageShift, std::size_t(1));
+
+	Span* span = PageCache::GetInstance().FetchSpan(realBytes >> kPageShift, alignPages);
+	span->obj_size = realBytes;
+#ifndef CONCURRENT_POOL_NO_STATS
+	largeAllocCount.fetch_add(1, std::memory_order_relaxed);
+#endif
+	void* ptr = (void*)((std::size_t)span->page_id << kPageShift);
+
+	if (HeapProfiler::Tick(bytes))
+		HeapProfiler::GetInstance().RecordSample(ptr, bytes);
+	return ptr;
+}
+
+void* ConcurrentRealloc(void* ptr, std::size_t bytes)
+{
+	if (ptr == nullptr)
+		return ConcurrentAlloc(bytes);
+
+	if (bytes == 0)
+		bytes = 1;
+
+	Span* span = PageCache::_idSpanMap.get((std::size_t)ptr >> kPageShift);
+	std::size_t oldSize = span->obj_size;
+	std::size_t realBytes = SizeClass::RoundUp(bytes);
+
+	HeapProfiler& profiler = HeapProfiler::GetInstance();
+
+	// 同一个桶内无需移动
+	if (realBytes == oldSize)
+	{
+		if (profiler.MaybeSampled(ptr))
+			profiler.MoveSample(ptr, ptr, bytes);
+		return ptr;
+	}
+
+	// 大对象在page cache中原地调整
+	if (oldSize > kMaxBytes && bytes > kMaxBytes
+		&& PageCache::GetInstance().ResizeSpan(span, realBytes >> kPageShift))
+	{
+		span->obj_size = realBytes;
+		void* newPtr = (void*)(span->page_id << kPageShift);
+		if (profiler.MaybeSampled(ptr))
+			profiler.MoveSample(ptr, newPtr, bytes);
+		return newPtr;
+	}
+
+	void* newPtr = ConcurrentAlloc(bytes);
+	memcpy(newPtr, ptr, (std::min)(bytes, oldSize));
+	ConcurrentDealloc(ptr);
+	return newPtr;
+}
+
+void ConcurrentDealloc(void* ptr)
+{
+	if (ptr == nullptr)
+		return;
+
+	HeapProfiler& profiler = HeapProfiler::GetInstance();
+	if (profiler.MaybeSampled(ptr))
+		profiler.RemoveSample(ptr);
+
+	// 小对象由页号直接得到桶，不读取span
+	std::size_t id = (std::size_t)ptr >> kPageShift;
+	std::size_t index = LookupClass(id);
+	if (index < kNFreeList)
+	{
+#ifdef CONCURRENT_POOL_DEBUG
+		assert(PageCache::_idSpanMap.get(id)->obj_size == SizeClass::ClassSize(index));
+#endif
+		DeallocateToCache(ptr, SizeClass::ClassSize(index));
+		return;
+	}
+
+	// 大于kMaxBytes，直接向pageCache释放内存
+	Span* span = PageCache::_idSpanMap.get(id);
+	assert(span->obj_size > kMaxBytes);
+#ifndef CONCURRENT_POOL_NO_STATS
+	largeFreeCount.fetch_add(1, std::memory_order_relaxed);
+#endif
+	PageCache::GetInstance().ReleaseSpanToPageCache(span);
+}
+
+std::size_t ConcurrentUsableSize(void* ptr)
+{
+	if (ptr == nullptr)
+		return 0;
+
+	return PageCache::_idSpanMap.get((std::size_t)ptr >> kPageShift)->obj_size;
+}
+
+void ConcurrentDealloc(void* ptr, std::size_t bytes)
+{
+	if (ptr == nullptr)
+		return;
+
+#ifdef CONCURRENT_POOL_DEBUG
+	Span* span = PageCache::_idSpanMap.get((std::size_t)ptr >> kPageShift);
+	assert(span && span->obj_size == SizeClass::RoundUp(bytes == 0 ? 1 : bytes));
+#endif
+
+	if (bytes > kMaxBytes)
+	{
+		ConcurrentDealloc(ptr);
+	}
+	else
+	{
+		HeapProfiler& profiler = HeapProfiler::GetInstance();
+		if (profiler.MaybeSampled(ptr))
+			profiler.RemoveSample(ptr);
+
+		DeallocateToCache(ptr, bytes);
+	}
+}
+
+std::size_t ConcurrentReleaseMemory(std::size_t bytes)
+{
+	// 中转缓存中的批先还给span，使全部空闲的span回到page cache
+	CentralCache::GetInstance().ReleaseTransferCaches(false);
+	return PageCache::GetInstance().ReleaseFreeSpans(bytes, 0);
+}
+
+void ConcurrentStartScavenger(std::uint64_t idleMs, std::size_t bytesPerSecond)
+{
+	Scavenger::GetInstance().Start(idleMs, bytesPerSecond);
+}
+
+void ConcurrentStopScavenger()
+{
+	Scavenger::GetInstance().Stop();
+}
+
+PoolStats ConcurrentGetStats()
+{
+	PoolStats stats;
+	ThreadCache::CollectAllStats(stats);
+
+	stats.thread_cache_metadata_bytes = ThreadCachePool::MemoryBytes();
+
+#ifdef CONCURRENT_POOL_PER_CPU
+	if (CpuCache::Enabled())
+		CpuCache::GetInstance().CollectStats(stats);
+#endif
+
+	CentralCache::GetInstance().CollectStats(stats);
+	PageCache::GetInstance().CollectStats(stats);
+
+#ifndef CONCURRENT_POOL_NO_STATS
+	stats.large_alloc_count = largeAllocCount.load(std::memory_order_relaxed);
+	stats.large_free_count = largeFreeCount.load(std::memory_order_relaxed);
+#endif
+	stats.system_alloc_bytes = systemAllocBytes.load(std::memory_order_relaxed);
+	stats.system_dealloc_bytes = systemDeallocBytes.load(std::memory_order_relaxed);
+	return stats;
+}
+
+void ConcurrentDumpStats(FILE* fp)
+{
+	PoolStats stats = ConcurrentGetStats();
+	stats.Print(fp);
+}
+
+void ConcurrentSetThreadCacheBudget(std::size_t bytes)
+{
+	ThreadCache::SetTotalBudget(bytes);
+}
+
+// 所有实例等价，互相可以释放对方申请的内存
+class PoolMemoryResource : public std::pmr::memory_resource
+{
+	// 大小是对齐的倍数时桶中的对象自然对齐
+	static bool Natural(std::size_t bytes, std::size_t align)
+	{
+		return align <= (std::size_t(1) << kPageShift) && (bytes & (align - 1)) == 0;
+	}
+
+	void* do_allocate(std::size_t bytes, std::size_t align) override
+	{
+		if (Natural(bytes, align))
+			return ConcurrentAlloc(bytes);
+		return ConcurrentAlignedAlloc(bytes, align);
+	}
+
+	void do_deallocate(void* ptr, std::size_t bytes, std::size_t align) override
+	{
+		if (Natural(bytes, align))
+			ConcurrentDealloc(ptr, bytes);
+		else
+			ConcurrentDealloc(ptr);
+	}
+
+	bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+	{
+		return dynamic_cast<const PoolMemoryResource*>(&other) != nullptr;
+	}
+};
+
+std::pmr::memory_resource* ConcurrentMemoryResource()
+{
+	static PoolMemoryResource resource;
+	return &resource;
+}
+
+void ConcurrentSetProfileSampleRate(std::size_t bytes)
+{
+	HeapProfiler::GetInstance().SetSampleRate(bytes);
+}
+
+void ConcurrentDumpHeapProfile(FILE* fp)
+{
+	HeapProfiler::GetInstance().Dump(fp);
+}
@@ -1,53 +1,141 @@
 #pragma once
+#include <new>
+#include <limits>
+#include <memory_resource>
+
 #include "common.h"
 #include "threadCache.h"
 #include "centralCache.h"
 #include "pageCache.h"
+#include "cpuCache.h"
+#include "scavenger.h"
+#include "stats.h"
+#include "heapProfiler.h"
+
+// 申请bytes字节的内存
+void* ConcurrentAlloc(std::size_t bytes);
+
+// 申请bytes字节且首地址按align字节对齐的内存，align须为2的次方
+// 不超过一页的对齐由对象大小为align倍数的桶满足，更大的对齐由page cache切出对齐的span满足
+// 只能通过不带大小的ConcurrentDealloc释放
+void* ConcurrentAlignedAlloc(std::size_t bytes, std::size_t align);
+
+// 将ptr调整为bytes字节，返回调整后的地址，ptr为nullptr时等同于ConcurrentAlloc
+// 对齐后仍属于同一个桶时原地返回，大对象优先并入相邻的空闲页或重新映射，都不满足时才申请新内存并复制
+void* ConcurrentRealloc(void* ptr, std::size_t bytes);
+
+// 释放ConcurrentAlloc申请的内存，小对象通过每页一个字节的桶下标映射查询大小，不读取span
+void ConcurrentDealloc(void* ptr);
+
+// 带大小的释放，bytes须与申请时传入的大小一致
+// 小对象直接由bytes映射到自由链表，只有大于kMaxBytes时才查询PageMap
+// 定义CONCURRENT_POOL_DEBUG时会用span中记录的大小校验bytes
+void ConcurrentDealloc(void* ptr, std::size_t bytes);
+
+// 返回ptr实际可用的字节数，即对齐后的大小
+std::size_t ConcurrentUsableSize(void* ptr);
+
+// 先把central cache中转缓存中的内存块还给span，再将page cache中空闲的内存归还系统
+// 最多归还bytes字节，返回实际归还系统的字节数
+// 地址空间仍被保留，再次使用时按需重新提交
+std::size_t ConcurrentReleaseMemory(std::size_t bytes);
+
+// 启动后台回收线程，将空闲超过idleMs毫秒的内存归还系统，每秒最多归还bytesPerSecond字节
+void ConcurrentStartScavenger(std::uint64_t idleMs, std::size_t bytesPerSecond);
+
+// 停止后台回收线程
+void ConcurrentStopScavenger();
+
+// 返回内存池的统计信息，各层依次加锁收集，不会阻塞其他线程的快速路径
+// 定义CONCURRENT_POOL_NO_STATS时不统计申请释放次数与thread cache中的字节数
+PoolStats ConcurrentGetStats();
+
+// 以可读的格式输出统计信息
+void ConcurrentDumpStats(FILE* fp);
+
+// 设置所有thread cache合计最多缓存的空闲字节数，默认32M
+// 每个thread cache注册时领取至多128K，需要更多时先领取未分配的预算，再从空闲的线程处偷取，每个最多4M
+// 已分配的预算合计不超过设置值，调小后超出的部分由之后的偷取逐步收回
+void ConcurrentSetThreadCacheBudget(std::size_t bytes);
+
+// 通过内存池申请释放的memory_resource，所有实例等价，用于std::pmr容器
+// 大小为对齐的倍数且对齐不超过一页时走ConcurrentAlloc与带大小的释放，否则走ConcurrentAlignedAlloc
+std::pmr::memory_resource* ConcurrentMemoryResource();
 
-// 定长内存池，用于代替new ThreadCache
-static ObjectPool<ThreadCache> objPool;
+// 开启采样堆分析，平均每申请bytes字节采样一次并记录调用栈，0表示关闭
+// 已在运行的其他线程在当前倒计数结束(至多1MB)后才开始采样
+void ConcurrentSetProfileSampleRate(std::size_t bytes);
 
-void* ConcurrentAlloc(std::size_t bytes)
+// 以pprof的heap profile格式输出仍存活的采样内存及其申请时的调用栈
+void ConcurrentDumpHeapProfile(FILE* fp);
+
+// 继承PoolObject的类型通过内存池new/delete
+// delete时编译器会传入对象大小，从而走带大小的释放
+struct PoolObject
 {
-	if (pTLS_threadCache == nullptr)
+	static void* operator new(std::size_t bytes)
 	{
-		std::unique_lock<std::mutex> lk(objPoolMtx);
-		pTLS_threadCache = objPool.New();
-		lk.unlock();
+		return ConcurrentAlloc(bytes);
 	}
 
-	// 若大于kMaxBytes，直接向pageCache获取内存
-	if (bytes > kMaxBytes)
+	static void* operator new[](std::size_t bytes)
 	{
-		std::size_t realBytes = SizeClass::RoundUp(bytes);
-		PageCache& pageCache = PageCache::GetInstance();
+		return ConcurrentAlloc(bytes);
+	}
 
-		// 记录大小
-		Span* span = pageCache.FetchSpan(bytes >> kPageShift);
-		span->obj_size = realBytes;
-		return (void*)((std::size_t)span->page_id << kPageShift);
+	static void operator delete(void* ptr, std::size_t bytes)
+	{
+		ConcurrentDealloc(ptr, bytes);
 	}
-	else
+
+	static void operator delete[](void* ptr, std::size_t bytes)
 	{
-		return pTLS_threadCache->Allocate(bytes);
+		ConcurrentDealloc(ptr, bytes);
 	}
-}
+};
 
-void ConcurrentDealloc(void* ptr)
+// 标准库容器使用的分配器，例如std::map<K, V, std::less<K>, PoolAllocator<std::pair<const K, V>>>
+// 容器释放时总会给出数量，走带大小的释放，小对象由大小直接映射到thread cache的自由链表，不查询PageMap
+// 大小为alignof(T)的倍数的桶中每个对象都按alignof(T)对齐，只有超过一页的对齐需要ConcurrentAlignedAlloc
+template <class T>
+struct PoolAllocator
 {
-	assert(pTLS_threadCache);
-	
-	std::size_t id = (std::size_t)ptr >> kPageShift;
-	PageCache& pageCache = PageCache::GetInstance();
-	Span* span = PageCache::_idSpanMap.get(id);
+	using value_type = T;
+
+	PoolAllocator() noexcept = default;
+
+	template <class U>
+	PoolAllocator(const PoolAllocator<U>&) noexcept {}
+
+	T* allocate(std::size_t n)
+	{
+		if (n > (std::numeric_limits<std::size_t>::max)() / sizeof(T))
+			throw std::bad_array_new_length();
+
+		if constexpr (alignof(T) > (std::size_t(1) << kPageShift))
+			return (T*)ConcurrentAlignedAlloc(n * sizeof(T), alignof(T));
+		else
+			return (T*)ConcurrentAlloc(n * sizeof(T));
+	}
 
-	// 若大于kMaxBytes，直接向pageCache释放内存
-	if (span->obj_size > kMaxBytes)
+	void deallocate(T* ptr, std::size_t n) noexcept
 	{
-		pageCache.ReleaseSpanToPageCache(span);
+		if constexpr (alignof(T) > (std::size_t(1) << kPageShift))
+			ConcurrentDealloc(ptr);
+		else
+			ConcurrentDealloc(ptr, n * sizeof(T));
 	}
-	else
+
+	// 内存池是全局的，任意两个分配器申请的内存都可以互相释放
+	template <class U>
+	bool operator==(const PoolAllocator<U>&) const noexcept
+	{
+		return true;
+	}
+
+	template <class U>
+	bool operator!=(const PoolAllocator<U>&) const noexcept
 	{
-		pTLS_threadCache->Deallocate(ptr);
+		return false;
 	}
-}
\ No newline at end of file
+};
@@ -0,0 +1,5 @@
+#include "cpuCache.h"
+
+#ifdef CONCURRENT_POOL_PER_CPU
+CpuCache CpuCache::_ins;
+#endif
@@ -0,0 +1,108 @@
+#pragma once
+#include <cstdint>
+#include <atomic>
+#include <thread>
+
+#include "threadCache.h"
+
+// 定义CONCURRENT_POOL_PER_CPU时启用per-CPU缓存，缓存的内存总量只与CPU核数有关，与线程数无关
+// 当前CPU编号从内核通过rseq维护的cpu_id中读取，无需系统调用
+// 不支持rseq(非Linux、glibc < 2.35或注册失败)时退回到每个线程一个ThreadCache
+#if defined(CONCURRENT_POOL_PER_CPU) && defined(__linux__) && __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define CONCURRENT_POOL_HAS_RSEQ 1
+#endif
+
+// 单例模式-饿汉
+class CpuCache
+{
+	// 最多支持的CPU数量，超出部分取模后与其他CPU共用缓存
+	static constexpr std::size_t kMaxCpus = 256;
+
+	// 每个CPU的缓存独占缓存行，避免伪共享
+	// 只有同一CPU上被抢占或迁移的线程才会竞争lock，临界区极短
+	struct alignas(64) Slot
+	{
+		std::atomic<bool> lock{ false };
+		ThreadCache cache;
+	};
+
+public:
+	CpuCache(const CpuCache&) = delete;
+
+	static CpuCache& GetInstance()
+	{
+		return _ins;
+	}
+
+	// 当前进程能否使用per-CPU缓存
+	static bool Enabled()
+	{
+#ifdef CONCURRENT_POOL_HAS_RSEQ
+		return __rseq_size > 0;
+#else
+		return false;
+#endif
+	}
+
+	void* Allocate(std::size_t bytes)
+	{
+		Slot& slot = Lock();
+		void* ptr = slot.cache.Allocate(bytes);
+		Unlock(slot);
+		return ptr;
+	}
+
+	void Deallocate(void* ptr, std::size_t bytes)
+	{
+		Slot& slot = Lock();
+		slot.cache.Deallocate(ptr, bytes);
+		Unlock(slot);
+	}
+
+	// 将所有CPU缓存的统计累加到stats中
+	void CollectStats(PoolStats& stats) const
+	{
+		for (const Slot& slot : _slots)
+		{
+			slot.cache.CollectStats(stats);
+		}
+	}
+
+private:
+	CpuCache() = default;
+
+	// 返回当前线程所在的CPU编号
+	static std::size_t CurrentCpu()
+	{
+#ifdef CONCURRENT_POOL_HAS_RSEQ
+		const struct rseq* rs = (const struct rseq*)((char*)__builtin_thread_pointer() + __rseq_offset);
+		return *(const volatile std::uint32_t*)&rs->cpu_id;
+#else
+		return 0;
+#endif
+	}
+
+	// 锁住当前CPU的缓存
+	Slot& Lock()
+	{
+		while (true)
+		{
+			Slot& slot = _slots[CurrentCpu() % kMaxCpus];
+			if (!slot.lock.exchange(true, std::memory_order_acquire))
+				return slot;
+
+			// 持有者被抢占，让出CPU后按新的CPU编号重试
+			while (slot.lock.load(std::memory_order_relaxed))
+				std::this_thread::yield();
+		}
+	}
+
+	void Unlock(Slot& slot)
+	{
+		slot.lock.store(false, std::memory_order_release);
+	}
+
+	Slot _slots[kMaxCpus];
+	static CpuCache _ins;
+};
@@ -0,0 +1,215 @@
+#include <cmath>
+#include <chrono>
+#include <vector>
+
+#include "heapProfiler.h"
+
+#if defined(__linux__) && __has_include(<execinfo.h>)
+#include <execinfo.h>
+#define CONCURRENT_POOL_HAS_BACKTRACE 1
+#endif
+
+HeapProfiler HeapProfiler::_ins;
+
+#ifdef _WIN32
+__declspec(thread) std::intptr_t tlsSampleCountdown = 0;
+static __declspec(thread) std::uint64_t tlsRandom = 0;
+static __declspec(thread) bool tlsInSampler = false;
+#else
+__thread std::intptr_t tlsSampleCountdown = 0;
+// 每个线程的随机数状态
+static __thread std::uint64_t tlsRandom = 0;
+// 采样过程中申请的内存不再采样，防止获取调用栈时递归
+static __thread bool tlsInSampler = false;
+#endif
+
+// 获取当前调用栈，返回深度
+static int CaptureStack(void** stack, int maxDepth)
+{
+#ifdef CONCURRENT_POOL_HAS_BACKTRACE
+	return backtrace(stack, maxDepth);
+#else
+	(void)stack;
+	(void)maxDepth;
+	return 0;
+#endif
+}
+
+void HeapProfiler::SetSampleRate(std::size_t bytes)
+{
+	// 首次获取调用栈时会加载libgcc_s并申请内存，先在采样路径之外完成
+	if (bytes > 0)
+	{
+		void* stack[kMaxDepth];
+		CaptureStack(stack, kMaxDepth);
+	}
+
+	_sampleBytes.store(bytes, std::memory_order_relaxed);
+	// 让当前线程立即使用新的间隔
+	tlsSampleCountdown = 0;
+}
+
+std::intptr_t HeapProfiler::NextSampleBytes()
+{
+	std::size_t rate = _sampleBytes.load(std::memory_order_relaxed);
+	if (rate == 0)
+		return kRecheckBytes;
+
+	if (tlsRandom == 0)
+	{
+		tlsRandom = (std::uint64_t)(std::uintptr_t)&tlsRandom
+			^ (std::uint64_t)std::chrono::steady_clock::now().time_since_epoch().count();
+		tlsRandom |= 1;
+	}
+
+	// xorshift64*
+	tlsRandom ^= tlsRandom >> 12;
+	tlsRandom ^= tlsRandom << 25;
+	tlsRandom ^= tlsRandom >> 27;
+	std::uint64_t r = tlsRandom * 0x2545F4914F6CDD1Dull;
+
+	// 取高53位得到(0, 1]上的均匀分布，再换算为指数分布
+	double u = ((r >> 11) + 1) * (1.0 / 9007199254740992.0);
+	double next = -std::log(u) * (double)rate;
+	return (std::intptr_t)(std::min)(next, (double)INTPTR_MAX / 2) + 1;
+}
+
+void HeapProfiler::RecordSample(void* ptr, std::size_t bytes)
+{
+	tlsSampleCountdown = NextSampleBytes();
+
+	// 倒计数只是检查是否已开启，或正在采样过程中
+	if (_sampleBytes.load(std::memory_order_relaxed) == 0 || tlsInSampler)
+		return;
+
+	// 获取调用栈可能申请内存，不能持有锁
+	void* stack[kMaxDepth];
+	tlsInSampler = true;
+	int depth = CaptureStack(stack, kMaxDepth);
+	tlsInSampler = false;
+
+	std::size_t index = Hash(ptr);
+
+	std::lock_guard<SpinLock> lk(_lock);
+	Sample* sample = _samplePool.New();
+	sample->ptr = ptr;
+	sample->bytes = bytes;
+	sample->depth = depth;
+	memcpy(sample->stack, stack, depth * sizeof(void*));
+
+	sample->next = _buckets[index];
+	_buckets[index] = sample;
+	_bucketSizes[index].fetch_add(1, std::memory_order_relaxed);
+	_liveSamples.fetch_add(1, std::memory_order_relaxed);
+}
+
+HeapProfiler::Sample* HeapProfiler::Unlink(void* ptr)
+{
+	std::size_t index = Hash(ptr);
+	for (Sample** cur = &_buckets[index]; *cur != nullptr; cur = &(*cur)->next)
+	{
+		if ((*cur)->ptr == ptr)
+		{
+			Sample* sample = *cur;
+			*cur = sample->next;
+			_bucketSizes[index].fetch_sub(1, std::memory_order_relaxed);
+			_liveSamples.fetch_sub(1, std::memory_order_relaxed);
+			return sample;
+		}
+	}
+	return nullptr;
+}
+
+void HeapProfiler::RemoveSample(void* ptr)
+{
+	std::lock_guard<SpinLock> lk(_lock);
+	Sample* sample = Unlink(ptr);
+	if (sample != nullptr)
+		_samplePool.Delete(sample);
+}
+
+void HeapProfiler::MoveSample(void* ptr, void* newPtr, std::size_t bytes)
+{
+	std::lock_guard<SpinLock> lk(_lock);
+	Sample* sample = Unlink(ptr);
+	if (sample == nullptr)
+		return;
+
+	std::size_t index = Hash(newPtr);
+	sample->ptr = newPtr;
+	sample->bytes = bytes;
+	sample->next = _buckets[index];
+	_buckets[index] = sample;
+	_bucketSizes[index].fetch_add(1, std::memory_order_relaxed);
+	_liveSamples.fetch_add(1, std::memory_order_relaxed);
+}
+
+void HeapProfiler::Dump(FILE* fp)
+{
+	std::size_t rate = _sampleBytes.load(std::memory_order_relaxed);
+
+	// 输出时可能申请或释放内存，期间不再采样
+	// 释放被采样的内存需要_lock，因此只在锁内复制采样，解锁后再输出
+	tlsInSampler = true;
+	std::vector<Sample> samples;
+	while (true)
+	{
+		// 在锁外预留空间，期间新增的采样超出预留时重试
+		samples.resize(_liveSamples.load(std::memory_order_relaxed) + 16);
+
+		std::size_t count = 0;
+		bool fits = true;
+		{
+			std::lock_guard<SpinLock> lk(_lock);
+			for (Sample* head : _buckets)
+			{
+				for (Sample* sample = head; sample != nullptr && fits; sample = sample->next)
+				{
+					if (count == samples.size())
+						fits = false;
+					else
+						samples[count++] = *sample;
+				}
+			}
+		}
+
+		if (fits)
+		{
+			samples.resize(count);
+			break;
+		}
+	}
+
+	std::size_t bytes = 0;
+	for (const Sample& sample : samples)
+		bytes += sample.bytes;
+
+	// 每个采样单独一行，由pprof按调用栈合并并按采样间隔换算
+	fprintf(fp, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n", samples.size(), bytes, samples.size(), bytes, rate);
+	for (const Sample& sample : samples)
+	{
+		fprintf(fp, "1: %zu [1: %zu] @", sample.bytes, sample.bytes);
+		for (int i = 0; i < sample.depth; ++i)
+		{
+			fprintf(fp, " %p", sample.stack[i]);
+		}
+		fprintf(fp, "\n");
+	}
+	tlsInSampler = false;
+
+	// pprof根据映射关系把地址解析为符号
+#ifdef __linux__
+	fprintf(fp, "\nMAPPED_LIBRARIES:\n");
+	FILE* maps = fopen("/proc/self/maps", "r");
+	if (maps != nullptr)
+	{
+		char line[512];
+		while (fgets(line, sizeof(line), maps) != nullptr)
+		{
+			fputs(line, fp);
+		}
+		fclose(maps);
+	}
+#endif
+	fflush(fp);
+}
@@ -0,0 +1,106 @@
+#pragma once
+#include <cstdio>
+#include <cstdint>
+#include <atomic>
+
+#include "common.h"
+
+// 每个线程距下一次采样还需申请的字节数，减到负数时采样
+#ifdef _WIN32
+extern __declspec(thread) std::intptr_t tlsSampleCountdown;
+#else
+extern __thread std::intptr_t tlsSampleCountdown;
+#endif
+
+// 采样堆分析器，单例模式-饿汉，默认关闭
+// 采样间隔服从均值为sampleBytes的指数分布，每个字节被采样的概率相同，与申请的大小和次序无关
+// 被采样的内存以地址为键记录在哈希表中，连同申请时的调用栈，释放时删除
+class HeapProfiler
+{
+	// 记录的最大调用栈深度
+	static constexpr int kMaxDepth = 32;
+
+	// 哈希表的桶数
+	static constexpr std::size_t kBuckets = 1 << 14;
+
+	// 关闭时每申请这么多字节检查一次是否已开启
+	static constexpr std::intptr_t kRecheckBytes = 1 << 20;
+
+	// 一次采样的记录
+	struct Sample
+	{
+		void* ptr;
+		std::size_t bytes;
+		int depth;
+		void* stack[kMaxDepth];
+		Sample* next;
+	};
+
+public:
+	HeapProfiler(const HeapProfiler&) = delete;
+
+	static HeapProfiler& GetInstance()
+	{
+		return _ins;
+	}
+
+	// 申请bytes字节后调用，倒计数结束时返回true，之后须调用RecordSample
+	// 未采样时只有一次减法和一次分支
+	static bool Tick(std::size_t bytes)
+	{
+		return (tlsSampleCountdown -= (std::intptr_t)bytes) < 0;
+	}
+
+	// 释放前调用，返回false时ptr一定未被采样，无需加锁
+	bool MaybeSampled(void* ptr) const
+	{
+		return _liveSamples.load(std::memory_order_relaxed) != 0
+			&& _bucketSizes[Hash(ptr)].load(std::memory_order_relaxed) != 0;
+	}
+
+	// 设置平均采样间隔(字节)，0表示关闭
+	// 已在运行的线程在当前倒计数结束后才使用新的间隔
+	void SetSampleRate(std::size_t bytes);
+
+	// 记录一次采样，并重新开始当前线程的倒计数
+	void RecordSample(void* ptr, std::size_t bytes);
+
+	// 删除ptr的采样记录，不存在时什么也不做
+	void RemoveSample(void* ptr);
+
+	// ptr原地调整或移动到newPtr后更新采样记录
+	void MoveSample(void* ptr, void* newPtr, std::size_t bytes);
+
+	// 以pprof的heap profile文本格式输出所有存活的采样
+	// 可用 pprof --text <程序> <文件> 查看，按采样间隔换算为估计的实际字节数
+	void Dump(FILE* fp);
+
+private:
+	constexpr HeapProfiler() = default;
+
+	static std::size_t Hash(void* ptr)
+	{
+		// 对象至少按8字节对齐，去掉低位后乘以奇数打散
+		std::uint64_t h = ((std::uint64_t)ptr >> 3) * 0x9E3779B97F4A7C15ull;
+		return (std::size_t)(h >> 40) & (kBuckets - 1);
+	}
+
+	// 下一次采样前需申请的字节数
+	std::intptr_t NextSampleBytes();
+
+	// 从链表中摘下ptr的记录，需持有_lock
+	Sample* Unlink(void* ptr);
+
+	std::atomic<std::size_t> _sampleBytes{ 0 };
+
+	// 存活的采样数，以及每个桶中的采样数，用于释放时不加锁地排除
+	std::atomic<std::size_t> _liveSamples{ 0 };
+	std::atomic<std::uint32_t> _bucketSizes[kBuckets] = {};
+
+	// 以下由_lock保护
+	SpinLock _lock;
+	Sample* _buckets[kBuckets] = {};
+	ObjectPool<Sample> _samplePool;
+
+	static HeapProfiler _ins;
+};
@@ -0,0 +1,291 @@
+// 以内存池替换malloc/free/new/delete等，编译为共享库后可通过LD_PRELOAD替换已有程序的内存分配
+// 只在共享库中编译，不要与使用系统malloc的程序链接在一起
+#include <cerrno>
+#include <cstdlib>
+#include <new>
+
+#include "concurrentPool.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+
+// malloc至少按16字节对齐，与glibc保持一致
+static constexpr std::size_t kMinAlign = 16;
+
+// malloc实际向内存池申请的大小
+// 大于8字节时向上取整到16的倍数，这样对应桶的大小也是16的倍数，对象自然按16字节对齐
+// 带大小的delete也必须使用相同的换算，才能映射到相同的桶
+static inline std::size_t MallocSize(std::size_t bytes)
+{
+	if (bytes <= 8)
+		return bytes;
+
+	return (bytes + kMinAlign - 1) & ~(kMinAlign - 1);
+}
+
+// 按align对齐申请，align为2的次方
+static void* AlignedAlloc(std::size_t align, std::size_t bytes)
+{
+	if (align <= kMinAlign)
+		return ConcurrentAlloc(MallocSize(bytes));
+
+	return ConcurrentAlignedAlloc(bytes, align);
+}
+
+// 通过环境变量开启采样堆分析
+// CONCURRENT_POOL_SAMPLE_BYTES: 平均采样间隔(字节)
+// CONCURRENT_POOL_PROFILE: 进程退出时写入heap profile的文件
+static void DumpProfileAtExit()
+{
+	FILE* fp = fopen(getenv("CONCURRENT_POOL_PROFILE"), "w");
+	if (fp == nullptr)
+		return;
+
+	ConcurrentDumpHeapProfile(fp);
+	fclose(fp);
+}
+
+// 加载时从环境变量读取配置
+__attribute__((constructor)) static void ConfigureFromEnv()
+{
+	const char* budget = getenv("CONCURRENT_POOL_THREAD_CACHE_BYTES");
+	if (budget != nullptr)
+		ConcurrentSetThreadCacheBudget(strtoull(budget, nullptr, 10));
+
+	const char* rate = getenv("CONCURRENT_POOL_SAMPLE_BYTES");
+	if (rate == nullptr)
+		return;
+
+	ConcurrentSetProfileSampleRate(strtoull(rate, nullptr, 10));
+	if (getenv("CONCURRENT_POOL_PROFILE") != nullptr)
+		atexit(DumpProfileAtExit);
+}
+
+extern "C"
+{
+
+void* malloc(std::size_t bytes)
+{
+	try
+	{
+		return ConcurrentAlloc(MallocSize(bytes));
+	}
+	catch (const std::bad_alloc&)
+	{
+		errno = ENOMEM;
+		return nullptr;
+	}
+}
+
+void free(void* ptr)
+{
+	ConcurrentDealloc(ptr);
+}
+
+void cfree(void* ptr)
+{
+	ConcurrentDealloc(ptr);
+}
+
+void* calloc(std::size_t num, std::size_t size)
+{
+	std::size_t bytes = num * size;
+	if (size != 0 && bytes / size != num)
+	{
+		errno = ENOMEM;
+		return nullptr;
+	}
+
+	void* ptr = malloc(bytes);
+	if (ptr != nullptr)
+		memset(ptr, 0, bytes);
+	return ptr;
+}
+
+void* realloc(void* ptr, std::size_t bytes)
+{
+	if (ptr != nullptr && bytes == 0)
+	{
+		free(ptr);
+		return nullptr;
+	}
+
+	try
+	{
+		return ConcurrentRealloc(ptr, MallocSize(bytes));
+	}
+	catch (const std::bad_alloc&)
+	{
+		errno = ENOMEM;
+		return nullptr;
+	}
+}
+
+void* memalign(std::size_t align, std::size_t bytes)
+{
+	if (align == 0 || (align & (align - 1)) != 0)
+	{
+		errno = EINVAL;
+		return nullptr;
+	}
+
+	try
+	{
+		return AlignedAlloc(align, bytes);
+	}
+	catch (const std::bad_alloc&)
+	{
+		errno = ENOMEM;
+		return nullptr;
+	}
+}
+
+int posix_memalign(void** res, std::size_t align, std::size_t bytes)
+{
+	if (align % sizeof(void*) != 0 || (align & (align - 1)) != 0 || align == 0)
+		return EINVAL;
+
+	void* ptr = memalign(align, bytes);
+	if (ptr == nullptr)
+		return ENOMEM;
+
+	*res = ptr;
+	return 0;
+}
+
+void* aligned_alloc(std::size_t align, std::size_t bytes)
+{
+	return memalign(align, bytes);
+}
+
+void* valloc(std::size_t bytes)
+{
+	return memalign(sysconf(_SC_PAGESIZE), bytes);
+}
+
+void* pvalloc(std::size_t bytes)
+{
+	std::size_t pageSize = sysconf(_SC_PAGESIZE);
+	return memalign(pageSize, (bytes + pageSize - 1) & ~(pageSize - 1));
+}
+
+std::size_t malloc_usable_size(void* ptr)
+{
+	return ConcurrentUsableSize(ptr);
+}
+
+void malloc_stats()
+{
+	ConcurrentDumpStats(stderr);
+}
+
+int malloc_trim(std::size_t pad)
+{
+	(void)pad;
+	return ConcurrentReleaseMemory(SIZE_MAX) > 0;
+}
+
+} // extern "C"
+
+void* operator new(std::size_t bytes)
+{
+	return ConcurrentAlloc(MallocSize(bytes));
+}
+
+void* operator new[](std::size_t bytes)
+{
+	return ConcurrentAlloc(MallocSize(bytes));
+}
+
+void* operator new(std::size_t bytes, const std::nothrow_t&) noexcept
+{
+	return malloc(bytes);
+}
+
+void* operator new[](std::size_t bytes, const std::nothrow_t&) noexcept
+{
+	return malloc(bytes);
+}
+
+void operator delete(void* ptr) noexcept
+{
+	ConcurrentDealloc(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+	ConcurrentDealloc(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+	ConcurrentDealloc(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept
+{
+	ConcurrentDealloc(ptr);
+}
+
+void operator delete(void* ptr, std::size_t bytes) noexcept
+{
+	ConcurrentDealloc(ptr, MallocSize(bytes));
+}
+
+void operator delete[](void* ptr, std::size_t bytes) noexcept
+{
+	ConcurrentDealloc(ptr, MallocSize(bytes));
+}
+
+void* operator new(std::size_t bytes, std::align_val_t align)
+{
+	return AlignedAlloc((std::size_t)align, bytes);
+}
+
+void* operator new[](std::size_t bytes, std::align_val_t align)
+{
+	return operator new(bytes, align);
+}
+
+void* operator new(std::size_t bytes, std::align_val_t align, const std::nothrow_t&) noexcept
+{
+	return memalign((std::size_t)align, bytes);
+}
+
+void* operator new[](std::size_t bytes, std::align_val_t align, const std::nothrow_t&) noexcept
+{
+	return memalign((std::size_t)align, bytes);
+}
+
+// 按对齐申请的内存所在的桶与bytes不对应，统一通过PageMap查询大小
+void operator delete(void* ptr, std::align_val_t) noexcept
+{
+	ConcurrentDealloc(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept
+{
+	ConcurrentDealloc(ptr);
+}
+
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept
+{
+	ConcurrentDealloc(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept
+{
+	ConcurrentDealloc(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept
+{
+	ConcurrentDealloc(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept
+{
+	ConcurrentDealloc(ptr);
+}
+
+#endif // _WIN32
@@ -1,102 +1,343 @@
+#include <cstdio>
+#include <chrono>
+
 #include "./pageCache.h"
 
 PageCache::PageMap PageCache::_idSpanMap;
-PageCache PageCache::_ins;
+PageCache::ClassMap PageCache::_idClassMap;
+std::atomic<std::uint64_t> PageCache::_classEpoch{ 0 };
+
+// 大页包含的页数
+static constexpr std::size_t kPagesPerHugePage = std::size_t(1) << (kHugePageShift - kPageShift);
 
-Span* PageCache::FetchSpan(std::size_t pageNum)
+// 向系统申请page cache使用的内存，首地址按alignPages页对齐
+// 大页模式下不小于一个大页的内存按大页对齐，并建议系统使用透明大页
+static void* SystemAllocPages(std::size_t pageNum, std::size_t alignPages = 1)
 {
-	assert(pageNum > 0);
+	std::size_t align = alignPages << kPageShift;
+#ifdef CONCURRENT_POOL_HUGEPAGE
+	if (pageNum >= kPagesPerHugePage)
+	{
+		void* ptr = SystemAllocAligned(pageNum << kPageShift, (std::max)(align, std::size_t(1) << kHugePageShift));
+		SystemAdviseHugePage(ptr, pageNum << kPageShift);
+		return ptr;
+	}
+#endif
+	return SystemAllocAligned(pageNum << kPageShift, align);
+}
 
-	std::unique_lock<std::recursive_mutex> lk(_pageMtx);
+// 物理内存状态不同的span能否合并
+#ifdef CONCURRENT_POOL_HUGEPAGE
+static constexpr bool kMergeReturned = true;
+#else
+static constexpr bool kMergeReturned = false;
+#endif
 
-	// 若pageNum大于pagecache的最大页数限制，直接向系统申请
-	if (pageNum >= kNPageList)
+// span是否由完整且对齐的大页组成
+static bool CoversHugePages(const Span* span)
+{
+	return span->page_id % kPagesPerHugePage == 0 && span->page_num % kPagesPerHugePage == 0;
+}
+
+Span* PageCache::FetchSpan(std::size_t pageNum, std::size_t alignPages)
+{
+	assert(pageNum > 0);
+	assert(alignPages > 0 && (alignPages & (alignPages - 1)) == 0);
+
+	// 若对齐所需的页数大于pagecache的最大页数限制，直接向系统申请
+	if (pageNum + alignPages - 1 >= kNPageList)
 	{
-		void* ptr = SystemAlloc(pageNum << kPageShift);
+		// 系统调用不涉及临界资源，无需加锁
+		void* ptr = SystemAllocPages(pageNum, alignPages);
+
+		std::unique_lock<CountingMutex> lk(_pageMtx);
 
 		// 与下文保持一致，建立一个span
-		Span* span = spanPool.New();
-		span->freeList.ReplaceHead(ptr, 1);
+		Span* span = SpanPool::New();
 		span->page_id = (std::size_t)ptr >> kPageShift;
 		span->page_num = pageNum;
+		span->is_used = true;
 
-		_idSpanMap.set(span->page_id, span);
+		// 因对齐而直接申请的span可能不足最大页数，释放后会进入_spanLists，需建立所有页号的映射
+		_idSpanMap.set_range(span->page_id, pageNum < kNPageList ? pageNum : 1, span);
+
+		return span;
+	}
+
+	// 对齐要求大于一页时多取alignPages - 1页，再将首尾多余的页切下归还
+	if (alignPages > 1)
+	{
+		Span* span = FetchSpan(pageNum + alignPages - 1);
 
+		std::unique_lock<CountingMutex> lk(_pageMtx);
+		std::size_t head = (alignPages - span->page_id % alignPages) % alignPages;
+		TrimSpan(span, head, span->page_num - head - pageNum);
 		return span;
 	}
 
+	std::unique_lock<CountingMutex> lk(_pageMtx);
+	return TakeOrAllocSpan(lk, pageNum);
+}
+
+Span* PageCache::FetchClassSpan(std::size_t pageNum, std::size_t index)
+{
+	assert(pageNum > 0 && pageNum < kNPageList && index < kNFreeList);
+
+	std::unique_lock<CountingMutex> lk(_pageMtx);
+	Span* span = TakeOrAllocSpan(lk, pageNum);
+	_idClassMap.set_range(span->page_id, span->page_num, (unsigned char)(index + 1));
+	return span;
+}
+
+Span* PageCache::TakeOrAllocSpan(std::unique_lock<CountingMutex>& lk, std::size_t pageNum)
+{
+	while (true)
+	{
+		Span* res = TakeSpan(pageNum);
+		if (res != nullptr)
+			return res;
+
+		// 先合并其他线程延迟归还的span后重试
+		if (DrainPending())
+			continue;
+
+		// 找不到更大的span，就向系统申请，申请期间不持有锁
+		lk.unlock();
+		void* ptr = SystemAllocPages(kNPageList - 1);
+		lk.lock();
+
+		Span* newSpan = SpanPool::New();
+		newSpan->page_id = (std::size_t)ptr >> kPageShift;
+		newSpan->page_num = kNPageList - 1;
+		newSpan->free_time = NowMs();
+
+		_idSpanMap.set(newSpan->page_id, newSpan);
+		_idSpanMap.set(newSpan->page_id + newSpan->page_num - 1, newSpan);
+
+		PushSpan(newSpan);
+	}
+}
+
+void PageCache::ReleaseSpanToPageCache(Span* span)
+{
+	// 大页span直接向系统释放
+	if (span->page_num >= kNPageList)
+	{
+		// 重新映射后首地址可能已改变，按页号计算
+		void* ptr = (void*)(span->page_id << kPageShift);
+		std::size_t bytes = span->page_num << kPageShift;
+
+		std::unique_lock<CountingMutex> lk(_pageMtx);
+		// 清除映射，防止munmap后地址被复用时合并到失效的span
+		_idSpanMap.set(span->page_id, nullptr);
+		SpanPool::Delete(span);
+		lk.unlock();
+
+		SystemDealloc(ptr, bytes);
+		return;
+	}
+
+	// 锁被占用时不等待，放入待合并栈
+	// span的is_used仍为true，在被合并前不会被其他span合并
+	std::unique_lock<CountingMutex> lk(_pageMtx, std::try_to_lock);
+	if (!lk.owns_lock())
+	{
+		Span* head = _pending.load(std::memory_order_relaxed);
+		do
+		{
+			span->next = head;
+		} while (!_pending.compare_exchange_weak(head, span,
+			std::memory_order_release, std::memory_order_relaxed));
+		return;
+	}
+
+	Coalesce(span);
+	DrainPending();
+}
+
+Span* PageCache::TakeSpan(std::size_t pageNum)
+{
+	// 通过位图找到不小于pageNum的第一个非空spanlist
+	std::size_t i = FindNonEmpty(pageNum);
+	if (i == kNPageList)
+		return nullptr;
+
 	// 如果pageNum页spanlist非空，直接返回
-	if (!_spanLists[pageNum].empty())
+	if (i == pageNum)
 	{
 		// 建立res中所有页号与res的映射
-		Span* res = _spanLists[pageNum].pop_front();
+		Span* res = _spanLists[pageNum].front();
+		EraseSpan(res);
 		res->is_used = true;
-		for (std::size_t id = res->page_id; id < res->page_num + res->page_id; ++id)
+
+		// 已归还系统的span需重新提交
+		if (res->is_returned)
 		{
-			_idSpanMap.set(id, res);
+			SystemRecommit((void*)(res->page_id << kPageShift), res->page_num << kPageShift);
+			_returnedPages -= res->page_num;
+			res->is_returned = false;
 		}
+
+		_idSpanMap.set_range(res->page_id, res->page_num, res);
 		return res;
 	}
 
-	// 走到这里说明pageNum页spanlist为空，向后寻找更大的span
-	for (int i = pageNum + 1; i < kNPageList; ++i)
+	// 切分更大的span
+	Span* theSpan = _spanLists[i].front();
+	EraseSpan(theSpan);
+	Span* res = SpanPool::New();
+
+	// 头切，剩余部分紧跟在res之后，使res之后能够原地扩展
+	res->is_used = true;
+	res->page_id = theSpan->page_id;
+	res->page_num = pageNum;
+	// 建立res中所有页号与res的映射
+	_idSpanMap.set_range(res->page_id, res->page_num, res);
+
+	// 剩余部分保持原状态，切出的部分需重新提交
+	if (theSpan->is_returned)
 	{
-		if (!_spanLists[i].empty())
-		{
-			Span* theSpan = _spanLists[i].pop_front();
-			Span* res = spanPool.New();
-
-			// 尾切
-			res->is_used = true;
-			res->page_id = theSpan->page_id + theSpan->page_num - pageNum;
-			res->page_num = pageNum;
-			// 建立res中所有页号与res的映射
-			for (std::size_t id = res->page_id; id < res->page_num + res->page_id; ++id)
-			{
-				_idSpanMap.set(id, res);
-			}
+		SystemRecommit((void*)(res->page_id << kPageShift), res->page_num << kPageShift);
+		_returnedPages -= res->page_num;
+	}
 
-			theSpan->page_num -= pageNum;
-			_spanLists[theSpan->page_num].push_front(theSpan);
+	theSpan->page_id += pageNum;
+	theSpan->page_num -= pageNum;
+	PushSpan(theSpan);
 
-			// 因为page cache中的span是未使用的，所以只需建立首尾页号的映射
-			_idSpanMap.set(theSpan->page_id, theSpan);
-			_idSpanMap.set(theSpan->page_id + theSpan->page_num - 1, theSpan);
+	// 因为page cache中的span是未使用的，所以只需建立首尾页号的映射
+	_idSpanMap.set(theSpan->page_id, theSpan);
+	_idSpanMap.set(theSpan->page_id + theSpan->page_num - 1, theSpan);
 
-			return res;
-		}
+	return res;
+}
+
+bool PageCache::ResizeSpan(Span* span, std::size_t pageNum)
+{
+	// 直接向系统申请的span通过重新映射调整大小
+	if (span->page_num >= kNPageList)
+	{
+		if (pageNum < kNPageList)
+			return false;
+
+		std::size_t align = std::size_t(1) << kPageShift;
+#ifdef CONCURRENT_POOL_HUGEPAGE
+		if (pageNum >= kPagesPerHugePage)
+			align = std::size_t(1) << kHugePageShift;
+#endif
+		void* ptr = SystemRemap((void*)(span->page_id << kPageShift),
+			span->page_num << kPageShift, pageNum << kPageShift, align);
+		if (ptr == nullptr)
+			return false;
+
+		std::unique_lock<CountingMutex> lk(_pageMtx);
+		// 原地址可能已被系统重新分配给其他span，只清除仍指向自己的映射
+		if (_idSpanMap.get(span->page_id) == span)
+			_idSpanMap.set(span->page_id, nullptr);
+
+		span->page_id = (std::size_t)ptr >> kPageShift;
+		span->page_num = pageNum;
+		_idSpanMap.set(span->page_id, span);
+		return true;
 	}
 
-	// 找不到更大的span，就向系统申请
-	void* ptr = SystemAlloc((kNPageList - 1) << kPageShift);
-	Span* newSpan = spanPool.New();
-	newSpan->page_id = (std::size_t)ptr >> kPageShift;
-	newSpan->page_num = kNPageList - 1;
-	newSpan->freeList.push_front(ptr);
+	if (pageNum >= kNPageList)
+		return false;
 
-	_idSpanMap.set(newSpan->page_id, newSpan);
-	_idSpanMap.set(newSpan->page_id + newSpan->page_num - 1, newSpan);
+	std::unique_lock<CountingMutex> lk(_pageMtx);
 
-	_spanLists[kNPageList - 1].push_front(newSpan);
+	// 缩小时切下尾部归还
+	if (pageNum <= span->page_num)
+	{
+		TrimSpan(span, 0, span->page_num - pageNum);
+		return true;
+	}
 
-	return FetchSpan(pageNum);
+	// 扩大时只能并入紧邻的后一个空闲span
+	std::size_t need = pageNum - span->page_num;
+	Span* nextSpan = _idSpanMap.get(span->page_id + span->page_num);
+	if (nextSpan == nullptr || nextSpan->is_used || nextSpan->page_num < need)
+		return false;
 
+	EraseSpan(nextSpan);
+	if (nextSpan->is_returned)
+	{
+		SystemRecommit((void*)(nextSpan->page_id << kPageShift), need << kPageShift);
+		_returnedPages -= need;
+	}
+
+	_idSpanMap.set_range(nextSpan->page_id, need, span);
+	span->page_num = pageNum;
+
+	if (nextSpan->page_num == need)
+	{
+		SpanPool::Delete(nextSpan);
+	}
+	else
+	{
+		// 剩余部分保持原状态
+		nextSpan->page_id += need;
+		nextSpan->page_num -= need;
+		_idSpanMap.set(nextSpan->page_id, nextSpan);
+		PushSpan(nextSpan);
+	}
+	return true;
 }
 
-void PageCache::ReleaseSpanToPageCache(Span* span)
+void PageCache::TrimSpan(Span* span, std::size_t head, std::size_t tail)
 {
-	std::unique_lock<std::recursive_mutex> lk(_pageMtx);
+	// span仍为使用中，切下的部分不会与span合并
+	if (head > 0)
+	{
+		Span* headSpan = SpanPool::New();
+		headSpan->page_id = span->page_id;
+		headSpan->page_num = head;
+		span->page_id += head;
+		span->page_num -= head;
+
+		_idSpanMap.set(headSpan->page_id, headSpan);
+		_idSpanMap.set(headSpan->page_id + head - 1, headSpan);
+		Coalesce(headSpan);
+	}
 
-	// 大页span直接向系统释放
-	if (span->page_num >= kNPageList)
+	if (tail > 0)
 	{
-		//_idSpanMap.erase(span->page_id);
-		SystemDealloc(span->freeList.begin(), span->obj_size);
-		spanPool.Delete(span);
-		return;
+		Span* tailSpan = SpanPool::New();
+		span->page_num -= tail;
+		tailSpan->page_id = span->page_id + span->page_num;
+		tailSpan->page_num = tail;
+
+		_idSpanMap.set(tailSpan->page_id, tailSpan);
+		_idSpanMap.set(tailSpan->page_id + tail - 1, tailSpan);
+		Coalesce(tailSpan);
 	}
+}
+
+void PageCache::MergeReturnedState(Span* span, Span* other)
+{
+	if (span->is_returned == other->is_returned)
+		return;
+
+	// 状态不同时合并结果视为已归还，仍有物理内存的部分也归还系统
+	// 已归还的部分没有被访问，不能视为重新提交，否则之后会被再次归还和计数
+	// 这样每页只归还和计数一次，取出时再重新提交
+	Span* backed = span->is_returned ? other : span;
+	SystemRelease((void*)(backed->page_id << kPageShift), backed->page_num << kPageShift);
+	_returnedPages += backed->page_num;
+	span->is_returned = true;
+}
 
+void PageCache::Coalesce(Span* span)
+{
 	span->is_used = false;
+
+	// 来自central cache的span清除桶下标的映射，之后这些页可能属于其他桶
+	if (span->obj_size > 0 && span->obj_size <= kMaxBytes)
+	{
+		_idClassMap.set_range(span->page_id, span->page_num, 0);
+		_classEpoch.fetch_add(1, std::memory_order_release);
+		span->obj_size = 0;
+	}
 	while (true)
 	{
 		// 寻找前一个span
@@ -111,15 +352,20 @@ void PageCache::ReleaseSpanToPageCache(Span* span)
 		// 合并后页数大于最大页数，停止合并
 		if (prevSpan->page_num + span->page_num > kNPageList - 1)
 			break;
+		// 物理内存状态不同的span不合并，否则无法记录哪些页已归还系统
+		// 大页模式下仍合并，以免大页内的碎片永远无法整体归还
+		if (prevSpan->is_returned != span->is_returned && !kMergeReturned)
+			break;
 
 		// 合并当前span和前一个span
-		_spanLists[prevSpan->page_num].erase(prevSpan);
+		EraseSpan(prevSpan);
+		MergeReturnedState(span, prevSpan);
 
 		span->page_id = prevSpan->page_id;
 		span->page_num += prevSpan->page_num;
 		_idSpanMap.set(prevSpan->page_id, span);
 
-		spanPool.Delete(prevSpan);
+		SpanPool::Delete(prevSpan);
 	}
 
 	while (true)
@@ -136,17 +382,173 @@ void PageCache::ReleaseSpanToPageCache(Span* span)
 		// 合并后页数大于最大页数，停止合并
 		if (nextSpan->page_num + span->page_num > kNPageList - 1)
 			break;
+		if (nextSpan->is_returned != span->is_returned && !kMergeReturned)
+			break;
 
 		// 合并当前span和后一个span
-		_spanLists[nextSpan->page_num].erase(nextSpan);
+		EraseSpan(nextSpan);
+		MergeReturnedState(span, nextSpan);
 
 		span->page_num += nextSpan->page_num;
 		_idSpanMap.set(nextSpan->page_id + nextSpan->page_num - 1, span);
 
-		spanPool.Delete(nextSpan);
+		SpanPool::Delete(nextSpan);
 	}
 	//  将合并完成的span放入spanlists中
-	_spanLists[span->page_num].push_front(span);
+	span->free_time = NowMs();
+	PushSpan(span);
+}
+
+bool PageCache::DrainPending()
+{
+	Span* cur = _pending.exchange(nullptr, std::memory_order_acquire);
+	if (cur == nullptr)
+		return false;
+
+	while (cur != nullptr)
+	{
+		// Coalesce会改写next，先保存
+		Span* next = cur->next;
+		Coalesce(cur);
+		cur = next;
+	}
+	return true;
+}
+
+void PageCache::PushSpan(Span* span)
+{
+	if (span->is_returned)
+		_spanLists[span->page_num].push_back(span);
+	else
+		_spanLists[span->page_num].push_front(span);
+	_nonEmpty[span->page_num / 64] |= std::uint64_t(1) << (span->page_num % 64);
+}
+
+void PageCache::EraseSpan(Span* span)
+{
+	_spanLists[span->page_num].erase(span);
+	if (_spanLists[span->page_num].empty())
+		_nonEmpty[span->page_num / 64] &= ~(std::uint64_t(1) << (span->page_num % 64));
+}
+
+std::size_t PageCache::FindNonEmpty(std::size_t pageNum) const
+{
+	std::size_t word = pageNum / 64;
+	// 屏蔽掉小于pageNum的位
+	std::uint64_t bits = _nonEmpty[word] & (~std::uint64_t(0) << (pageNum % 64));
+	while (true)
+	{
+		if (bits != 0)
+			return word * 64 + CountTrailingZeros(bits);
+
+		if (++word == kBitmapWords)
+			return kNPageList;
+		bits = _nonEmpty[word];
+	}
 }
 
+std::size_t PageCache::ReleaseFreeSpans(std::size_t bytes, std::uint64_t idleMs)
+{
+	std::size_t released = 0;
+
+	std::unique_lock<CountingMutex> lk(_pageMtx);
+	DrainPending();
+
+	// 从大到小遍历，优先归还大的span
+	for (std::size_t i = kNPageList - 1; i > 0 && released < bytes; --i)
+	{
+		while (released < bytes)
+		{
+			// 未归还的span在链表前部，遇到已归还的span即可停止查找
+			std::uint64_t now = NowMs();
+			Span* span = nullptr;
+			for (Span* cur = _spanLists[i].begin(); cur != _spanLists[i].end() && !cur->is_returned; cur = cur->next)
+			{
+#ifdef CONCURRENT_POOL_HUGEPAGE
+				// 只归还完整的大页，部分归还会使系统拆散大页
+				if (!CoversHugePages(cur))
+					continue;
+#endif
+				if (now - cur->free_time >= idleMs)
+				{
+					span = cur;
+					break;
+				}
+			}
+			if (span == nullptr)
+				break;
+
+			// 归还期间标记为使用中，防止被其他span合并
+			EraseSpan(span);
+			span->is_used = true;
+
+			lk.unlock();
+			SystemRelease((void*)(span->page_id << kPageShift), span->page_num << kPageShift);
+			lk.lock();
+
+			released += span->page_num << kPageShift;
+			_returnedPages += span->page_num;
+			span->is_returned = true;
+			Coalesce(span);
+		}
+	}
+
+	return released;
+}
 
+void PageCache::CollectStats(PoolStats& stats)
+{
+	stats.page_lock_acquisitions += _pageMtx.Acquisitions();
+	stats.page_lock_contentions += _pageMtx.Contentions();
+
+	std::unique_lock<CountingMutex> lk(_pageMtx);
+	for (std::size_t i = 1; i < kNPageList; ++i)
+	{
+		for (Span* span = _spanLists[i].begin(); span != _spanLists[i].end(); span = span->next)
+		{
+			++stats.page_heap_spans[i];
+			stats.page_heap_free_bytes += i << kPageShift;
+		}
+	}
+	stats.page_heap_returned_bytes += _returnedPages << kPageShift;
+	stats.span_metadata_bytes += SpanPool::MemoryBytes();
+#ifdef CONCURRENT_POOL_SPAN_BITMAP
+	stats.span_metadata_bytes += SpanBitmapPool::MemoryBytes();
+#endif
+	// 页号到span与到桶下标的两个映射
+	stats.page_map_bytes += _idSpanMap.MemoryBytes() + _idClassMap.MemoryBytes();
+}
+
+std::uint64_t PageCache::NowMs()
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+std::size_t PageCache::HugePageBackedBytes() const
+{
+	std::size_t bytes = 0;
+#ifdef __linux__
+	FILE* fp = fopen("/proc/self/smaps", "r");
+	if (fp == nullptr)
+		return 0;
+
+	// 每个映射区以"起始-结束 ..."开头，属于内存池的映射区起始页在_idSpanMap中有记录
+	char line[512];
+	bool owned = false;
+	while (fgets(line, sizeof(line), fp) != nullptr)
+	{
+		std::size_t start = 0, end = 0, kb = 0;
+		if (sscanf(line, "%zx-%zx ", &start, &end) == 2)
+		{
+			owned = _idSpanMap.get(start >> kPageShift) != nullptr;
+		}
+		else if (owned && sscanf(line, "AnonHugePages: %zu kB", &kb) == 1)
+		{
+			bytes += kb * 1024;
+		}
+	}
+	fclose(fp);
+#endif
+	return bytes;
+}
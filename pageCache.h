@@ -1,56 +1,147 @@
 #pragma once
+#include <new>
+
 #include "common.h"
 #include "pageMap.h"
+#include "stats.h"
 
 // 同central cache为单例模式
+// 定义CONCURRENT_POOL_FLAT_PAGEMAP时，64位Linux上的PageMap改为单层平铺数组，查询只需一次读取
 class PageCache
 {
 #ifdef _WIN32 //windows x86 or x64
 
 #ifdef _WIN64 //x64 windows
-	typedef PageMap3<64 - kPageShift> PageMap;
+	template <class T> using PageMapOf = PageMap3<64 - kPageShift, T>;
 #else //x86 windows
-	typedef PageMap2<32 - kPageShift> PageMap;
+	template <class T> using PageMapOf = PageMap2<32 - kPageShift, T>;
 #endif //end of _WIN64
 
 #else //unix
 
 #ifdef __x86_64__ //x64 unix
-	typedef PageMap3<64 - kPageShift> PageMap;
+#if defined(CONCURRENT_POOL_FLAT_PAGEMAP) && defined(__linux__)
+	// 用户态地址不超过47位，平铺数组保留128G地址空间
+	template <class T> using PageMapOf = PageMapFlat<47 - kPageShift, T>;
+#else
+	template <class T> using PageMapOf = PageMap3<64 - kPageShift, T>;
+#endif
 #elif __i386__ //x86 unix
-	typedef PageMap2<32 - kPageShift> PageMap;
+	template <class T> using PageMapOf = PageMap2<32 - kPageShift, T>;
 #endif //end of __x86_64__
 
 #endif //end of _WIN32
+	typedef PageMapOf<Span*> PageMap;
+	typedef PageMapOf<unsigned char> ClassMap;
 public:
 
 	// page_id到span的映射
 	//static std::unordered_map<std::size_t, Span*> _idSpanMap;
 	static PageMap _idSpanMap;
 
-	std::recursive_mutex _pageMtx;
+	// page_id到桶下标加1的紧凑映射，0表示不属于central cache中的span
+	// 每页一个字节，释放时不必读取span就能确定桶，central cache取得span时建立，span归还page cache时清除
+	static ClassMap _idClassMap;
+
+	// 每次清除_idClassMap中的映射时加1，使各线程缓存的页号到桶下标的映射失效
+	static std::atomic<std::uint64_t> _classEpoch;
 
+	CountingMutex _pageMtx;
+
+	// 同central cache，首次使用时构造且从不析构
 	static PageCache& GetInstance()
 	{
-		return _ins;
+		alignas(PageCache) static char storage[sizeof(PageCache)];
+		static PageCache* ins = new (storage) PageCache;
+		return *ins;
 	}
 
-	// 从_spanList中返回有pageNum页的span
-	// 线程安全，内有递归调用因此使用recursive_mutex
-	Span* FetchSpan(std::size_t pageNum);
+	// 从_spanList中返回有pageNum页的span，span的首页号为alignPages的倍数
+	// 线程安全
+	Span* FetchSpan(std::size_t pageNum, std::size_t alignPages = 1);
+
+	// 为第index个桶返回有pageNum页的span，并在_idClassMap中建立所有页号的映射
+	// 线程安全
+	Span* FetchClassSpan(std::size_t pageNum, std::size_t index);
 
-	// 将span归还给page cache, 以及执行后续的合并操作
+	// 将使用中的span调整为pageNum页，成功返回true，span的首页号可能改变
+	// 缩小时将尾部归还，扩大时并入紧邻的空闲页，超过最大页数限制的span通过重新映射调整
 	// 线程安全
+	bool ResizeSpan(Span* span, std::size_t pageNum);
+
+	// 将span归还给page cache, 以及执行后续的合并操作
+	// 线程安全，若_pageMtx正被占用则放入待合并栈后立即返回，由持有锁的线程稍后合并
 	void ReleaseSpanToPageCache(Span* span);
 
+	// 将空闲时间不少于idleMs毫秒的span的物理内存归还系统，最多归还bytes字节，返回实际归还的字节数
+	// 每归还一个span都会释放一次锁，不会长时间阻塞申请
+	std::size_t ReleaseFreeSpans(std::size_t bytes, std::uint64_t idleMs);
+
+	// 已归还系统的空闲内存字节数
+	std::size_t ReturnedBytes()
+	{
+		std::unique_lock<CountingMutex> lk(_pageMtx);
+		return _returnedPages << kPageShift;
+	}
+
+	// 将每个桶的span数量、空闲字节数以及span与PageMap的元数据开销累加到stats中
+	void CollectStats(PoolStats& stats);
+
+	// 内存池中由透明大页映射的字节数，从/proc/self/smaps统计，仅支持Linux
+	std::size_t HugePageBackedBytes() const;
+
+	// 返回当前时间(毫秒)
+	static std::uint64_t NowMs();
+
 private:
-	PageCache() {}
+	PageCache()
+	{
+		_idSpanMap.Init();
+		_idClassMap.Init();
+	}
 
 	PageCache(const PageCache&) = delete;
 
+	// 以下函数均需持有_pageMtx
+
+	// 取出一个pageNum页的span，没有足够大的span时返回nullptr
+	Span* TakeSpan(std::size_t pageNum);
+
+	// 取出一个pageNum页的span，没有时先合并待合并栈，仍没有则向系统申请，申请期间暂时释放lk
+	Span* TakeOrAllocSpan(std::unique_lock<CountingMutex>& lk, std::size_t pageNum);
+
+	// 从span首尾切下head页和tail页，切下的部分合并后放入_spanLists
+	void TrimSpan(Span* span, std::size_t head, std::size_t tail);
+
+	// 与前后空闲的span合并后放入_spanLists
+	void Coalesce(Span* span);
+
+	// 合并前处理两个span的物理内存状态，结果记录在span中
+	// 状态不同时把仍有物理内存的一方归还系统，合并结果为已归还
+	void MergeReturnedState(Span* span, Span* other);
+
+	// 合并待合并栈中的所有span，返回是否合并了span
+	bool DrainPending();
+
+	// 向_spanLists放入和删除span，同时维护_nonEmpty
+	// 已归还系统的span放在链表尾部，使申请时优先使用仍有物理内存的span
+	void PushSpan(Span* span);
+	void EraseSpan(Span* span);
+
+	// 返回不小于pageNum的第一个非空spanlist的下标，不存在时返回kNPageList
+	std::size_t FindNonEmpty(std::size_t pageNum) const;
+
 	// 桶的下标代表当前桶存有的span的页数
 	// 其中span的freelist是未经处理的整块大内存（没有记录size和next）
 	SpanList _spanLists[kNPageList];
 
-	static PageCache _ins;
+	// 非空spanlist的位图，第i位为1表示_spanLists[i]非空
+	static constexpr std::size_t kBitmapWords = (kNPageList + 63) / 64;
+	std::uint64_t _nonEmpty[kBitmapWords] = {};
+
+	// 待合并的span组成的无锁栈，通过span->next链接
+	std::atomic<Span*> _pending{ nullptr };
+
+	// 已归还系统的空闲页数
+	std::size_t _returnedPages = 0;
 };
\ No newline at end of file
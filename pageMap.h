@@ -1,10 +1,10 @@
 #pragma once
 #include "common.h"
 
-static constexpr std::size_t kAllocSize = 1024 * 1024;
+// 以下PageMap将页号映射到T，默认为页号所在的Span，未建立映射的页号返回T()
 
 // Two-level radix tree
-template <int BITS>
+template <int BITS, class T = Span*>
 class PageMap2 {
 private:
 	// The leaf node (regardless of pointer size) always maps 2^15 entries;
@@ -18,43 +18,61 @@ private:
 
 	// Leaf node
 	struct Leaf {
-		Span* values[kLeafLength];
+		T values[kLeafLength];
 	};
 
-	Leaf* root_[kRootLength];             // Pointers to 32 child nodes
+	Leaf* root_[kRootLength] = {};             // Pointers to 32 child nodes
+	size_t bytes_ = 0;
 
 public:
 	typedef uintptr_t Number;
 
-	//explicit TCMalloc_PageMap2(void* (*allocator)(size_t)) {
-	PageMap2() {
-		//allocator_ = allocator;
-		memset(root_, 0, sizeof(root_));
+	// 常量初始化，叶子节点在Init中一次建立
+	constexpr PageMap2() = default;
 
+	// 由PageCache的构造函数调用
+	void Init() {
 		PreallocateMoreMemory();
 	}
 
-	Span* get(Number k) const {
+	T get(Number k) const {
 		const Number i1 = k >> kLeafBits;
-		const Number i2 = k & (kLeafBits - 1);
+		const Number i2 = k & (kLeafLength - 1);
 		if ((k >> BITS) > 0 || root_[i1] == nullptr) {
-			return nullptr;
+			return T();
 		}
 		return root_[i1]->values[i2];
 	}
 
-	void set(Number k, Span* v) {
+	void set(Number k, T v) {
 		const Number i1 = k >> kLeafBits;
-		const Number i2 = k & (kLeafBits - 1);
-		assert(i1 < kRootLength && i2 < kLeafBits);
+		const Number i2 = k & (kLeafLength - 1);
+		assert(i1 < kRootLength && i2 < kLeafLength);
 		root_[i1]->values[i2] = v;
 	}
 
+	// 将[start, start + n)的页号都映射到v，每个叶子节点内连续填充
+	void set_range(Number start, size_t n, T v) {
+		assert(n > 0 && ((start + n - 1) >> BITS) == 0);
+		const Number end = start + n;
+		while (start < end) {
+			const Number i2 = start & (kLeafLength - 1);
+			const size_t count = (std::min)((size_t)(end - start), (size_t)(kLeafLength - i2));
+			std::fill_n(root_[start >> kLeafBits]->values + i2, count, v);
+			start += count;
+		}
+	}
+
+	// 节点占用的字节数
+	size_t MemoryBytes() const {
+		return bytes_;
+	}
+
 private:
 
 	bool Ensure(Number start, size_t n) {
 		for (Number key = start; key <= start + n - 1;) {
-			const Number i1 = key >> kLeafLength;
+			const Number i1 = key >> kLeafBits;
 
 			// Check for overflow
 			if (i1 >= kRootLength)
@@ -64,11 +82,11 @@ private:
 			if (root_[i1] == nullptr) {
 				//Leaf* leaf = reinterpret_cast<Leaf*>((*allocator_)(sizeof(Leaf)));
 				//if (leaf == NULL) return false;
-				static ObjectPool<Leaf>	leafPool(kAllocSize);
-				Leaf* leaf = (Leaf*)leafPool.New();
+				Leaf* leaf = ConcurrentObjectPool<Leaf>::New();
 
 				memset(leaf, 0, sizeof(*leaf));
 				root_[i1] = leaf;
+				bytes_ += sizeof(Leaf);
 			}
 
 			// Advance key past whatever is covered by this leaf node
@@ -79,12 +97,12 @@ private:
 
 	void PreallocateMoreMemory() {
 		// Allocate enough to keep track of all possible pages
-		Ensure(0, 1 << BITS);
+		Ensure(0, (size_t)1 << BITS);
 	}
 };
 
 // Three-level radix tree
-template <int BITS>
+template <int BITS, class T = Span*>
 class PageMap3 {
 private:
 	
@@ -100,13 +118,12 @@ private:
 
 	// Leaf node
 	struct Leaf {
-		Span* values[kLeafLength];
+		T values[kLeafLength];
 	};
 
 	Leaf* NewLeaf() const
 	{
-		static ObjectPool<Leaf> leafPool(kAllocSize) ;
-		return (Leaf*)leafPool.New();
+		return ConcurrentObjectPool<Leaf>::New();
 	}
 
 	struct Node {
@@ -119,24 +136,22 @@ private:
 
 	Node* NewNode() const
 	{
-		static ObjectPool<Node> nodePool(kAllocSize);
-		return (Node*)nodePool.New();
+		return ConcurrentObjectPool<Node>::New();
 	}
 
-	Node* root_[kRootLength];             // Pointers to 32 child nodes
+	Node* root_[kRootLength] = {};             // Pointers to 32 child nodes
+	size_t bytes_ = 0;
 
 public:
 	typedef uintptr_t Number;
 
-	//explicit TCMalloc_PageMap2(void* (*allocator)(size_t)) {
-	PageMap3() {
-		//allocator_ = allocator;
-		memset(root_, 0, sizeof(root_));
+	// 常量初始化，作为静态成员时在任何构造函数运行前即可使用
+	constexpr PageMap3() = default;
 
-		//PreallocateMoreMemory();
-	}
+	// 节点在set时按需建立，无需初始化
+	void Init() {}
 
-	Span* get(Number k) const {
+	T get(Number k) const {
 		const Number i1 = k >> (kLeafBits + kMidBits);
 		const Number i2 = (k >> kLeafBits) & (kMidLength - 1);
 		const Number i3 = k & (kLeafLength - 1);
@@ -144,29 +159,52 @@ public:
 
 		if ((k >> BITS) > 0 || root_[i1] == nullptr ||
 			root_[i1]->leaves[i2] == nullptr) {
-			return nullptr;
+			return T();
 		}
 		return root_[i1]->leaves[i2]->values[i3];
 	}
 
-	void set(Number k, Span* s) {
+	void set(Number k, T s) {
 		assert(k >> BITS == 0);
+		EnsureLeaf(k)->values[k & (kLeafLength - 1)] = s;
+	}
+
+	// 将[start, start + n)的页号都映射到s，每个叶子节点只查找一次，再连续填充
+	void set_range(Number start, size_t n, T s) {
+		assert(n > 0 && ((start + n - 1) >> BITS) == 0);
+		const Number end = start + n;
+		while (start < end) {
+			const Number i3 = start & (kLeafLength - 1);
+			const size_t count = (std::min)((size_t)(end - start), (size_t)(kLeafLength - i3));
+			std::fill_n(EnsureLeaf(start)->values + i3, count, s);
+			start += count;
+		}
+	}
+
+	// 节点占用的字节数
+	size_t MemoryBytes() const {
+		return bytes_;
+	}
+
+private:
+
+	// 返回页号k所在的叶子节点，不存在时建立
+	Leaf* EnsureLeaf(Number k) {
 		const Number i1 = k >> (kLeafBits + kMidBits);
 		const Number i2 = (k >> kLeafBits) & (kMidLength - 1);
-		const Number i3 = k & (kLeafLength - 1);
 		if (root_[i1] == nullptr)
 		{
 			root_[i1] = NewNode();
+			bytes_ += sizeof(Node);
 		}
 		if (root_[i1]->leaves[i2] == nullptr)
 		{
 			root_[i1]->leaves[i2] = NewLeaf();
+			bytes_ += sizeof(Leaf);
 		}
-		root_[i1]->leaves[i2]->values[i3] = s;
+		return root_[i1]->leaves[i2];
 	}
 
-private:
-
 	//bool Ensure(Number start, size_t n) {
 	//	for (Number key = start; key <= start + n - 1;) {
 	//		const Number i1 = key >> kLeafLength;
@@ -197,3 +235,71 @@ private:
 	//	Ensure(0, 1 << BITS);
 	//}
 };
+
+// 单层平铺的PageMap，一次保留覆盖全部页号的数组，查询只需一次按下标的读取
+// 以MAP_NORESERVE保留地址空间，不计入系统的提交量，只有写入过的部分才分配物理页
+// 未写入部分读到的是共享的零页，因此查询任意地址都是安全的
+template <int BITS, class T = Span*>
+class PageMapFlat {
+private:
+	static constexpr size_t kLength = (size_t)1 << BITS;
+	// 数组每个系统页(4K)存放的页号数量，用于统计写入过的系统页
+	static constexpr size_t kEntriesPerPage = 4096 / sizeof(T);
+	static constexpr size_t kPageCount = kLength / kEntriesPerPage;
+
+	T* values_ = nullptr;
+	// 数组中已写入的系统页的位图
+	std::uint64_t* touched_ = nullptr;
+	size_t bytes_ = 0;
+
+public:
+	typedef uintptr_t Number;
+
+	constexpr PageMapFlat() = default;
+
+	// 保留数组与位图的地址空间，由PageCache的构造函数调用
+	void Init() {
+		if (values_ != nullptr)
+			return;
+		values_ = (T*)SystemReserve(kLength * sizeof(T));
+		touched_ = (std::uint64_t*)SystemReserve(kPageCount / 8);
+	}
+
+	T get(Number k) const {
+		if ((k >> BITS) > 0) {
+			return T();
+		}
+		return values_[k];
+	}
+
+	void set(Number k, T v) {
+		assert(k >> BITS == 0);
+		Touch(k, 1);
+		values_[k] = v;
+	}
+
+	// 将[start, start + n)的页号都映射到v
+	void set_range(Number start, size_t n, T v) {
+		assert(n > 0 && ((start + n - 1) >> BITS) == 0);
+		Touch(start, n);
+		std::fill_n(values_ + start, n, v);
+	}
+
+	// 已写入的系统页占用的字节数
+	size_t MemoryBytes() const {
+		return bytes_;
+	}
+
+private:
+	// 记录[start, start + n)所在的系统页，首次写入的系统页计入向系统申请的字节数
+	void Touch(Number start, size_t n) {
+		for (Number p = start / kEntriesPerPage; p <= (start + n - 1) / kEntriesPerPage; ++p) {
+			const std::uint64_t bit = (std::uint64_t)1 << (p & 63);
+			if ((touched_[p >> 6] & bit) == 0) {
+				touched_[p >> 6] |= bit;
+				bytes_ += 4096;
+				systemAllocBytes.fetch_add(4096, std::memory_order_relaxed);
+			}
+		}
+	}
+};
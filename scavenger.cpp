@@ -0,0 +1,59 @@
+#include "scavenger.h"
+#include "centralCache.h"
+
+Scavenger Scavenger::_ins;
+
+void Scavenger::Start(std::uint64_t idleMs, std::size_t bytesPerSecond)
+{
+	std::unique_lock<std::mutex> lk(_mtx);
+	_idleMs = idleMs;
+	_bytesPerSecond = bytesPerSecond;
+
+	if (_running)
+		return;
+
+	_running = true;
+	_thread = std::thread(&Scavenger::Run, this);
+}
+
+void Scavenger::Stop()
+{
+	std::unique_lock<std::mutex> lk(_mtx);
+	if (!_running)
+		return;
+
+	_running = false;
+	lk.unlock();
+	_cv.notify_all();
+
+	_thread.join();
+}
+
+void Scavenger::Run()
+{
+	std::unique_lock<std::mutex> lk(_mtx);
+	std::uint64_t lastPlunder = PageCache::NowMs();
+	while (_running)
+	{
+		_cv.wait_for(lk, std::chrono::milliseconds(kTickMs));
+		if (!_running)
+			break;
+
+		// 按速率计算本轮最多归还的字节数，至少归还一页
+		std::size_t budget = _bytesPerSecond * kTickMs / 1000;
+		if (budget == 0)
+			budget = 1 << kPageShift;
+		std::uint64_t idleMs = _idleMs;
+
+		lk.unlock();
+		// 每隔idleMs把期间一直没有被取用的中转缓存的批还给span，空闲的桶不会一直占用span
+		std::uint64_t now = PageCache::NowMs();
+		if (now - lastPlunder >= idleMs)
+		{
+			CentralCache::GetInstance().ReleaseTransferCaches(true);
+			lastPlunder = now;
+		}
+		PageCache::GetInstance().ReleaseFreeSpans(budget, idleMs);
+		lk.lock();
+	}
+}
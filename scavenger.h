@@ -0,0 +1,49 @@
+#pragma once
+#include <thread>
+#include <condition_variable>
+
+#include "pageCache.h"
+
+// 后台回收线程，定期将page cache中空闲较久的span的物理内存归还系统
+// 同时把central cache中转缓存里空闲较久的批还给span
+// 单例模式-饿汉，需显式调用Start启动
+class Scavenger
+{
+	// 每轮检查的间隔(毫秒)
+	static constexpr std::uint64_t kTickMs = 100;
+
+public:
+	Scavenger(const Scavenger&) = delete;
+
+	static Scavenger& GetInstance()
+	{
+		return _ins;
+	}
+
+	// 启动后台线程，已启动时只更新参数
+	// idleMs: span空闲超过该时间才归还    bytesPerSecond: 每秒最多归还的字节数，限制对申请的影响
+	void Start(std::uint64_t idleMs, std::size_t bytesPerSecond);
+
+	// 停止后台线程并等待其退出
+	void Stop();
+
+	~Scavenger()
+	{
+		Stop();
+	}
+
+private:
+	Scavenger() = default;
+
+	void Run();
+
+	std::mutex _mtx;
+	std::condition_variable _cv;
+	std::thread _thread;
+	bool _running = false;
+
+	std::uint64_t _idleMs = 0;
+	std::size_t _bytesPerSecond = 0;
+
+	static Scavenger _ins;
+};
@@ -0,0 +1,83 @@
+#include "stats.h"
+
+void PoolStats::Print(FILE* fp) const
+{
+	const double kKB = 1024.0;
+
+	std::size_t threadBytes = 0, transferBytes = 0, centralBytes = 0, spanBytes = 0;
+	std::uint64_t allocs = large_alloc_count, frees = large_free_count;
+	std::uint64_t locks = 0, contentions = 0, remote = 0, reclaimed = 0;
+	for (const ClassStats& cls : classes)
+	{
+		threadBytes += cls.thread_cache_bytes;
+		transferBytes += cls.transfer_cache_bytes;
+		centralBytes += cls.central_cache_bytes;
+		spanBytes += cls.span_bytes;
+		allocs += cls.alloc_count;
+		frees += cls.free_count;
+		locks += cls.lock_acquisitions;
+		contentions += cls.lock_contentions;
+		remote += cls.remote_free_objects;
+		reclaimed += cls.remote_reclaim_objects;
+	}
+
+	fprintf(fp, "------------------------------------------------\n");
+	fprintf(fp, "system mapped       : %12.1f KB (alloc %.1f KB, dealloc %.1f KB)\n",
+		(system_alloc_bytes - system_dealloc_bytes) / kKB, system_alloc_bytes / kKB, system_dealloc_bytes / kKB);
+	fprintf(fp, "central spans       : %12.1f KB\n", spanBytes / kKB);
+	fprintf(fp, "  thread cache free : %12.1f KB (%zu caches, budget %.1f KB, claimed %.1f KB)\n", threadBytes / kKB,
+		thread_caches, thread_cache_budget / kKB, thread_cache_claimed_budget / kKB);
+	fprintf(fp, "  transfer free     : %12.1f KB\n", transferBytes / kKB);
+	fprintf(fp, "  central free      : %12.1f KB\n", centralBytes / kKB);
+	fprintf(fp, "page heap free      : %12.1f KB (returned %.1f KB)\n",
+		page_heap_free_bytes / kKB, page_heap_returned_bytes / kKB);
+	fprintf(fp, "metadata            : %12.1f KB (span %.1f KB, thread cache %.1f KB, page map %.1f KB)\n",
+		(span_metadata_bytes + thread_cache_metadata_bytes + page_map_bytes) / kKB,
+		span_metadata_bytes / kKB, thread_cache_metadata_bytes / kKB, page_map_bytes / kKB);
+	fprintf(fp, "alloc / free        : %llu / %llu (large %llu / %llu)\n",
+		(unsigned long long)allocs, (unsigned long long)frees,
+		(unsigned long long)large_alloc_count, (unsigned long long)large_free_count);
+	fprintf(fp, "locks (contended)   : central %llu (%llu), page %llu (%llu)\n",
+		(unsigned long long)locks, (unsigned long long)contentions,
+		(unsigned long long)page_lock_acquisitions, (unsigned long long)page_lock_contentions);
+	fprintf(fp, "remote free         : %llu (reclaimed %llu)\n",
+		(unsigned long long)remote, (unsigned long long)reclaimed);
+
+	fprintf(fp, "------------------------------------------------\n");
+	fprintf(fp, "%6s %12s %12s %10s %6s %10s %6s %10s %10s %10s %6s %10s %10s %10s\n",
+		"class", "allocs", "frees", "fetches", "batch", "releases", "batch",
+		"thread KB", "transfer", "central", "spans", "span KB", "locks", "contended");
+	for (const ClassStats& cls : classes)
+	{
+		if (cls.alloc_count == 0 && cls.fetch_count == 0 && cls.span_count == 0)
+			continue;
+
+		fprintf(fp, "%6zu %12llu %12llu %10llu %6.1f %10llu %6.1f %10.1f %10.1f %10.1f %6zu %10.1f %10llu %10llu\n",
+			cls.size, (unsigned long long)cls.alloc_count, (unsigned long long)cls.free_count,
+			(unsigned long long)cls.fetch_count,
+			cls.fetch_count ? (double)cls.fetch_objects / cls.fetch_count : 0.0,
+			(unsigned long long)cls.release_count,
+			cls.release_count ? (double)cls.release_objects / cls.release_count : 0.0,
+			cls.thread_cache_bytes / kKB, cls.transfer_cache_bytes / kKB, cls.central_cache_bytes / kKB,
+			cls.span_count, cls.span_bytes / kKB,
+			(unsigned long long)cls.lock_acquisitions, (unsigned long long)cls.lock_contentions);
+	}
+
+	fprintf(fp, "------------------------------------------------\n");
+	fprintf(fp, "%6s %10s %10s\n", "thread", "cached KB", "budget KB");
+	for (std::size_t i = 0; i < thread_caches && i < kMaxThreadStats; ++i)
+	{
+		fprintf(fp, "%6zu %10.1f %10.1f\n", i, threads[i].cached_bytes / kKB, threads[i].budget_bytes / kKB);
+	}
+
+	fprintf(fp, "------------------------------------------------\n");
+	fprintf(fp, "%6s %8s %10s\n", "pages", "spans", "free KB");
+	for (std::size_t i = 1; i < kNPageList; ++i)
+	{
+		if (page_heap_spans[i] == 0)
+			continue;
+
+		fprintf(fp, "%6zu %8zu %10.1f\n", i, page_heap_spans[i],
+			(double)(page_heap_spans[i] * i << kPageShift) / kKB);
+	}
+}
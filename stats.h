@@ -0,0 +1,128 @@
+#pragma once
+#include <cstdio>
+#include <cstdint>
+#include <atomic>
+
+#include "common.h"
+
+// 只由一个线程写入、可由其他线程读取的计数器
+// 写入使用relaxed的load和store而不是原子加，开销与普通变量相同
+class StatCounter
+{
+public:
+	void Add(std::uint64_t n = 1)
+	{
+		_value.store(_value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+
+	std::uint64_t Get() const
+	{
+		return _value.load(std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<std::uint64_t> _value{ 0 };
+};
+
+// thread cache中每个桶的计数
+struct ClassCounters
+{
+	// 申请与释放次数
+	StatCounter alloc;
+	StatCounter free;
+	// 向central cache申请的次数与得到的内存块总数
+	StatCounter fetch;
+	StatCounter fetched;
+	// 向central cache归还的次数与归还的内存块总数
+	StatCounter release;
+	StatCounter released;
+	// 放入远程释放链表的内存块数，以及从中取回的内存块数
+	StatCounter remote;
+	StatCounter reclaimed;
+};
+
+// 每个桶的统计
+struct ClassStats
+{
+	// 对象大小
+	std::size_t size = 0;
+
+	// 申请与释放次数，定义CONCURRENT_POOL_NO_STATS时为0
+	std::uint64_t alloc_count = 0;
+	std::uint64_t free_count = 0;
+
+	// thread cache与central cache之间的移动次数与内存块数，相除即平均批大小
+	std::uint64_t fetch_count = 0;
+	std::uint64_t fetch_objects = 0;
+	std::uint64_t release_count = 0;
+	std::uint64_t release_objects = 0;
+
+	// 定义CONCURRENT_POOL_REMOTE_FREE时，由非持有者放入远程释放链表的内存块数，以及被取回的内存块数
+	std::uint64_t remote_free_objects = 0;
+	std::uint64_t remote_reclaim_objects = 0;
+
+	// 缓存在各层中的空闲内存字节数
+	std::size_t thread_cache_bytes = 0;
+	std::size_t transfer_cache_bytes = 0;
+	std::size_t central_cache_bytes = 0;
+
+	// central cache持有的span数量与字节数
+	std::size_t span_count = 0;
+	std::size_t span_bytes = 0;
+
+	// central cache中该桶的锁的加锁次数，以及其中需要等待的次数
+	std::uint64_t lock_acquisitions = 0;
+	std::uint64_t lock_contentions = 0;
+};
+
+// 每个thread cache缓存的字节数与预算
+struct ThreadCacheStats
+{
+	std::size_t cached_bytes = 0;
+	std::size_t budget_bytes = 0;
+};
+
+// 整个内存池的统计，由ConcurrentGetStats生成
+struct PoolStats
+{
+	// 最多记录这么多个thread cache各自的预算
+	static constexpr std::size_t kMaxThreadStats = 64;
+
+	ClassStats classes[kNFreeList];
+
+	// 大于kMaxBytes的对象的申请与释放次数
+	std::uint64_t large_alloc_count = 0;
+	std::uint64_t large_free_count = 0;
+
+	// page cache的锁的加锁次数，以及其中需要等待的次数
+	std::uint64_t page_lock_acquisitions = 0;
+	std::uint64_t page_lock_contentions = 0;
+
+	// page cache每个桶中的span数量，下标为页数
+	std::size_t page_heap_spans[kNPageList] = {};
+	// page cache中空闲的字节数，以及其中已归还系统的字节数
+	std::size_t page_heap_free_bytes = 0;
+	std::size_t page_heap_returned_bytes = 0;
+
+	// 累计向系统申请与释放的字节数，两者之差即当前占用的地址空间
+	std::size_t system_alloc_bytes = 0;
+	std::size_t system_dealloc_bytes = 0;
+
+	// 元数据占用的字节数
+	std::size_t span_metadata_bytes = 0;
+	std::size_t thread_cache_metadata_bytes = 0;
+	std::size_t page_map_bytes = 0;
+
+	// 存活的thread cache数量
+	std::size_t thread_caches = 0;
+
+	// 所有thread cache合计的预算，以及已分配给各thread cache的部分
+	// 调小合计预算后，后者在被偷取收回之前可能暂时超过前者
+	std::size_t thread_cache_budget = 0;
+	std::size_t thread_cache_claimed_budget = 0;
+	// 前kMaxThreadStats个thread cache各自的情况
+	ThreadCacheStats threads[kMaxThreadStats];
+
+	// 输出可读的统计信息
+	void Print(FILE* fp) const;
+};
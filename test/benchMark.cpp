@@ -3,85 +3,787 @@
 #include <atomic>
 
 #include <vector>
+#include <chrono>
+#include <random>
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
 
-void BenchMarkTest(int rounds, int works, int times)
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// 多种负载下对比内存池与glibc malloc
+// 每个负载运行两遍：第一遍只计总耗时得到吞吐量，第二遍逐次计时得到延迟分布
+// 用法: ./benchMark [线程数] [负载名...]
+//
+// 扩展性测试: ./benchMark --sweep N [负载名...]
+// 线程数从1倍增到N，每个线程绑定到一个核，输出CSV，包括每次操作的硬件计数以及
+// thread cache未命中、central cache与page cache的加锁和等待次数，用于判断哪一层先成为瓶颈
+
+// 读取时间戳计数器，非x86平台退化为纳秒
+static inline unsigned long long ReadCycles()
 {
-	std::atomic<size_t> tcCost(0);
-	std::atomic<size_t> tcAllocCost(0), tcDeallocCost(0);
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// 每纳秒的时间戳计数，用steady_clock校准
+static double CyclesPerNs()
+{
+	auto begin = std::chrono::steady_clock::now();
+	unsigned long long c1 = ReadCycles();
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	unsigned long long c2 = ReadCycles();
+	auto end = std::chrono::steady_clock::now();
+
+	double ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count();
+	return (c2 - c1) / ns;
+}
 
-	std::atomic<size_t> cost(0);
-	std::atomic<size_t> allocCost(0), deallocCost(0);
+// 当前线程的硬件性能计数器，只统计用户态
+// 不支持或没有权限(见/proc/sys/kernel/perf_event_paranoid)时读数为负
+class PerfCounters
+{
+public:
+	enum { kCycles, kInstructions, kL1dMisses, kLlcMisses, kDtlbMisses, kEvents };
 
-	std::vector<std::thread> threads(works);
+	static const char* Name(int event)
+	{
+		static const char* names[kEvents] = { "cycles", "instructions", "l1d_misses", "llc_misses", "dtlb_misses" };
+		return names[event];
+	}
 
-	for (auto& t : threads)
+	PerfCounters()
 	{
-		t = std::thread([&, times]() {
-			std::vector<void*> ptrs(times);
+#ifdef __linux__
+		const std::uint64_t kCacheReadMiss = (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+		const std::uint32_t types[kEvents] = { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+			PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE };
+		const std::uint64_t configs[kEvents] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+			PERF_COUNT_HW_CACHE_L1D | kCacheReadMiss, PERF_COUNT_HW_CACHE_MISSES,
+			PERF_COUNT_HW_CACHE_DTLB | kCacheReadMiss };
 
-			for (int j = 0; j < rounds; ++j)
+		for (int i = 0; i < kEvents; ++i)
+		{
+			perf_event_attr attr;
+			memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			attr.type = types[i];
+			attr.config = configs[i];
+			attr.disabled = 1;
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			// 计数器不够用时内核会轮换，按实际计数的时间比例换算
+			attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+			_fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		}
+#endif
+	}
+
+	~PerfCounters()
+	{
+#ifdef __linux__
+		for (int fd : _fds)
+		{
+			if (fd >= 0)
+				close(fd);
+		}
+#endif
+	}
+
+	void Start()
+	{
+#ifdef __linux__
+		for (int fd : _fds)
+		{
+			if (fd >= 0)
 			{
-				int begin1 = clock();
-				for (int i = 0; i < times; ++i)
-				{
-					// ptrs[i] = ConcurrentAlloc(i % 20);
-					// ptrs[i] = ConcurrentAlloc(i % (64 * 1024));
-					ptrs[i] = ConcurrentAlloc(8 * 1024 * i);
-				}
-				int end1 = clock();
+				ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+				ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+			}
+		}
+#endif
+	}
 
-				int begin2 = clock();
-				for (int i = 0; i < times; ++i)
-				{
-					ConcurrentDealloc(ptrs[i]);
-				}
-				int end2 = clock();
+	// 停止计数并将读数累加到values中，某个事件不可用时将其置为负数
+	void Stop(double values[kEvents])
+	{
+		for (int i = 0; i < kEvents; ++i)
+		{
+			std::uint64_t data[3] = {};
+#ifdef __linux__
+			if (_fds[i] >= 0)
+			{
+				ioctl(_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+				if (read(_fds[i], data, sizeof(data)) != sizeof(data))
+					data[2] = 0;
+			}
+#endif
+			if (data[2] == 0 || values[i] < 0)
+				values[i] = -1;
+			else
+				values[i] += (double)data[0] * data[1] / data[2];
+		}
+	}
 
-				tcCost += end1 - begin1 + end2 - begin2;
-				tcAllocCost += end1 - begin1;
-				tcDeallocCost += end2 - begin2;
+private:
+	int _fds[kEvents] = { -1, -1, -1, -1, -1 };
+};
 
-				int begin3 = clock();
-				for (int i = 0; i < times; ++i)
-				{
-					// ptrs[i] = malloc(i % 20);
-					// ptrs[i] = malloc(i % (64 * 1024));
-					ptrs[i] = malloc(8 * 1024 * i);
-				}
-				int end3 = clock();
+// 将当前线程绑定到允许使用的第index个核上(超过核数时循环)
+static void PinThread(int index)
+{
+#ifdef __linux__
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		return;
 
-				int begin4 = clock();
-				for (int i = 0; i < times; ++i)
-				{
-					free(ptrs[i]);
-				}
-				int end4 = clock();
+	int count = CPU_COUNT(&allowed);
+	int target = index % count;
+	for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+	{
+		if (CPU_ISSET(cpu, &allowed) && target-- == 0)
+		{
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cpu, &set);
+			pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+			return;
+		}
+	}
+#else
+	(void)index;
+#endif
+}
+
+// 被测的分配器
+struct Allocator
+{
+	const char* name;
+	void* (*alloc)(std::size_t);
+	void (*dealloc)(void*);
+	void* (*realloc)(void*, std::size_t);
+};
+
+static void PoolDealloc(void* ptr)
+{
+	ConcurrentDealloc(ptr);
+}
+
+static const Allocator kAllocators[] = {
+	{ "pool", ConcurrentAlloc, PoolDealloc, ConcurrentRealloc },
+	{ "malloc", malloc, free, realloc },
+};
+
+// 对数线性直方图，每个2的次方区间再等分为32个桶，相对误差不超过1/32
+class Histogram
+{
+	static constexpr int kSubBits = 5;
+	static constexpr std::size_t kSub = 1 << kSubBits;
+
+public:
+	void Add(unsigned long long value)
+	{
+		++_counts[Index(value)];
+		++_total;
+		_sum += value;
+	}
+
+	void Merge(const Histogram& other)
+	{
+		for (std::size_t i = 0; i < kBuckets; ++i)
+			_counts[i] += other._counts[i];
+		_total += other._total;
+		_sum += other._sum;
+	}
+
+	double Mean() const
+	{
+		return _total == 0 ? 0 : (double)_sum / _total;
+	}
+
+	// 第q分位数所在桶的下界
+	unsigned long long Percentile(double q) const
+	{
+		unsigned long long rank = (unsigned long long)(q * _total);
+		unsigned long long seen = 0;
+		for (std::size_t i = 0; i < kBuckets; ++i)
+		{
+			seen += _counts[i];
+			if (seen > rank)
+				return LowerBound(i);
+		}
+		return 0;
+	}
+
+private:
+	static std::size_t Index(unsigned long long value)
+	{
+		if (value < kSub)
+			return (std::size_t)value;
+
+		int exp = 63 - __builtin_clzll(value);
+		return ((std::size_t)(exp - kSubBits + 1) << kSubBits) | ((value >> (exp - kSubBits)) & (kSub - 1));
+	}
+
+	static unsigned long long LowerBound(std::size_t index)
+	{
+		if (index < kSub)
+			return index;
+
+		int exp = (int)(index >> kSubBits) + kSubBits - 1;
+		return (kSub + (index & (kSub - 1))) << (exp - kSubBits);
+	}
+
+	static constexpr std::size_t kBuckets = 64 << kSubBits;
+
+	unsigned long long _counts[kBuckets] = {};
+	unsigned long long _total = 0;
+	unsigned long long _sum = 0;
+};
+
+// 每个线程的上下文，经由它调用分配器，timed时记录每次操作的周期数
+struct Context
+{
+	const Allocator* allocator = nullptr;
+	bool timed = false;
+	std::size_t ops = 0;
+	Histogram hist;
+	// 只含释放，用于单独比较每次释放的周期数
+	Histogram freeHist;
+
+	void* Alloc(std::size_t bytes)
+	{
+		++ops;
+		if (!timed)
+			return Touch(allocator->alloc(bytes));
+
+		unsigned long long begin = ReadCycles();
+		void* ptr = allocator->alloc(bytes);
+		hist.Add(ReadCycles() - begin);
+		return Touch(ptr);
+	}
+
+	void Dealloc(void* ptr)
+	{
+		++ops;
+		if (!timed)
+			return allocator->dealloc(ptr);
+
+		unsigned long long begin = ReadCycles();
+		allocator->dealloc(ptr);
+		unsigned long long cycles = ReadCycles() - begin;
+		hist.Add(cycles);
+		freeHist.Add(cycles);
+	}
+
+	void* Realloc(void* ptr, std::size_t bytes)
+	{
+		++ops;
+		if (!timed)
+			return Touch(allocator->realloc(ptr, bytes));
+
+		unsigned long long begin = ReadCycles();
+		void* res = allocator->realloc(ptr, bytes);
+		hist.Add(ReadCycles() - begin);
+		return Touch(res);
+	}
+
+	// 写入首字节，模拟真实程序对内存的使用
+	static void* Touch(void* ptr)
+	{
+		*(volatile char*)ptr = 1;
+		return ptr;
+	}
+};
+
+// 自旋屏障，用于各线程按轮次同步
+class SpinBarrier
+{
+public:
+	explicit SpinBarrier(int n) :_n(n) {}
+
+	void Wait()
+	{
+		unsigned gen = _gen.load(std::memory_order_acquire);
+		if (_count.fetch_add(1, std::memory_order_acq_rel) + 1 == _n)
+		{
+			_count.store(0, std::memory_order_relaxed);
+			_gen.store(gen + 1, std::memory_order_release);
+			return;
+		}
+		while (_gen.load(std::memory_order_acquire) == gen)
+			std::this_thread::yield();
+	}
+
+private:
+	int _n;
+	std::atomic<int> _count{ 0 };
+	std::atomic<unsigned> _gen{ 0 };
+};
+
+// 单生产者单消费者环形队列，用于跨线程传递待释放的指针
+class SpscRing
+{
+	static constexpr std::size_t kCap = 1024;
+
+public:
+	bool Push(void* ptr)
+	{
+		std::size_t tail = _tail.load(std::memory_order_relaxed);
+		if (tail - _head.load(std::memory_order_acquire) == kCap)
+			return false;
+		_slots[tail & (kCap - 1)] = ptr;
+		_tail.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	void* Pop()
+	{
+		std::size_t head = _head.load(std::memory_order_relaxed);
+		if (head == _tail.load(std::memory_order_acquire))
+			return nullptr;
+		void* ptr = _slots[head & (kCap - 1)];
+		_head.store(head + 1, std::memory_order_release);
+		return ptr;
+	}
+
+	// 生产者不再放入
+	void Close()
+	{
+		_closed.store(true, std::memory_order_release);
+	}
+
+	bool Closed() const
+	{
+		return _closed.load(std::memory_order_acquire);
+	}
+
+private:
+	alignas(64) std::atomic<std::size_t> _head{ 0 };
+	alignas(64) std::atomic<std::size_t> _tail{ 0 };
+	std::atomic<bool> _closed{ false };
+	void* _slots[kCap];
+};
+
+// 一次运行中所有线程共享的状态
+struct Shared
+{
+	explicit Shared(int threads) :barrier(threads), rings(threads / 2 + 1), slots(threads) {}
+
+	SpinBarrier barrier;
+	// producer/consumer中每对线程一个队列
+	std::vector<SpscRing> rings;
+	// larson中每个线程持有的对象数组，每轮交换一次
+	std::vector<std::vector<void*>> slots;
+};
+
+// 预先生成的申请大小序列，避免在计时循环中生成随机数
+typedef std::vector<std::size_t> Sizes;
 
-				cost += end3 - begin3 + end4 - begin4;
-				allocCost += end3 - begin3;
-				deallocCost += end4 - begin4;
+static Sizes UniformSizes(std::size_t n, std::size_t lo, std::size_t hi, unsigned seed)
+{
+	std::mt19937_64 rng(seed);
+	std::uniform_int_distribution<std::size_t> dist(lo, hi);
+	Sizes sizes(n);
+	for (std::size_t& size : sizes)
+		size = dist(rng);
+	return sizes;
+}
+
+// 对数正态分布，中位数约64字节，大部分对象小于1K，长尾延伸到kMaxBytes
+static Sizes LogNormalSizes(std::size_t n, unsigned seed)
+{
+	std::mt19937_64 rng(seed);
+	std::lognormal_distribution<double> dist(std::log(64.0), 1.3);
+	Sizes sizes(n);
+	for (std::size_t& size : sizes)
+		size = (std::size_t)(std::min)((std::max)(dist(rng), 1.0), (double)kMaxBytes);
+	return sizes;
+}
+
+static const std::size_t kSizeCount = 1 << 16;
+
+// 每个负载的参数与执行函数，ops为每个线程的目标操作次数
+struct Workload
+{
+	const char* name;
+	std::size_t ops;
+	void (*run)(Context& ctx, Shared& shared, int id, int threads, std::size_t ops);
+};
+
+// 固定16字节，每次申请64个后按相反顺序释放
+static void TinyWorkload(Context& ctx, Shared&, int, int, std::size_t ops)
+{
+	void* ptrs[64];
+	while (ctx.ops < ops)
+	{
+		for (void*& ptr : ptrs)
+			ptr = ctx.Alloc(16);
+		for (int i = 63; i >= 0; --i)
+			ctx.Dealloc(ptrs[i]);
+	}
+}
+
+// 保持window个存活对象，每次释放最早的一个并申请新的
+static void WindowWorkload(Context& ctx, const Sizes& sizes, std::size_t window, std::size_t ops)
+{
+	std::vector<void*> ptrs(window, nullptr);
+	std::size_t i = 0;
+	while (ctx.ops < ops)
+	{
+		void*& ptr = ptrs[i % window];
+		if (ptr != nullptr)
+			ctx.Dealloc(ptr);
+		ptr = ctx.Alloc(sizes[i % sizes.size()]);
+		++i;
+	}
+	for (void* ptr : ptrs)
+	{
+		if (ptr != nullptr)
+			ctx.Dealloc(ptr);
+	}
+}
+
+// [1, kMaxBytes]上均匀分布
+static void UniformWorkload(Context& ctx, Shared&, int id, int, std::size_t ops)
+{
+	WindowWorkload(ctx, UniformSizes(kSizeCount, 1, kMaxBytes, 100 + id), 256, ops);
+}
+
+// 对数正态分布，更接近真实程序
+static void LogNormalWorkload(Context& ctx, Shared&, int id, int, std::size_t ops)
+{
+	WindowWorkload(ctx, LogNormalSizes(kSizeCount, 200 + id), 256, ops);
+}
+
+// (kMaxBytes, 1M]的大对象
+static void LargeWorkload(Context& ctx, Shared&, int id, int, std::size_t ops)
+{
+	WindowWorkload(ctx, UniformSizes(kSizeCount, kMaxBytes + 1, 1 << 20, 300 + id), 16, ops);
+}
+
+// 偶数线程申请，经队列交给下一个线程释放，所有释放都是跨线程的
+static void ProducerConsumerWorkload(Context& ctx, Shared& shared, int id, int threads, std::size_t ops)
+{
+	SpscRing& ring = shared.rings[id / 2];
+	// 奇数个线程时最后一个线程没有搭档，自己申请并释放
+	if (id % 2 == 0 && id + 1 == threads)
+	{
+		WindowWorkload(ctx, LogNormalSizes(kSizeCount, 400 + id), 1024, ops);
+		return;
+	}
+
+	if (id % 2 == 0)
+	{
+		Sizes sizes = LogNormalSizes(kSizeCount, 400 + id);
+		for (std::size_t i = 0; i < ops; ++i)
+		{
+			void* ptr = ctx.Alloc(sizes[i % sizes.size()]);
+			while (!ring.Push(ptr))
+				std::this_thread::yield();
+		}
+		ring.Close();
+	}
+	else
+	{
+		while (true)
+		{
+			void* ptr = ring.Pop();
+			if (ptr != nullptr)
+			{
+				ctx.Dealloc(ptr);
+				continue;
 			}
 
-		});
+			// 先确认已关闭再取空队列，关闭前放入的指针都能取到
+			if (ring.Closed())
+			{
+				while ((ptr = ring.Pop()) != nullptr)
+					ctx.Dealloc(ptr);
+				break;
+			}
+			std::this_thread::yield();
+		}
 	}
+}
+
+// Larson: 每个线程持有一组长期存活的对象，随机替换其中一个
+// 每轮结束后各线程交换对象数组，于是释放的大多是其他线程申请的对象
+static void LarsonWorkload(Context& ctx, Shared& shared, int id, int threads, std::size_t ops)
+{
+	const std::size_t kSlots = 1000, kRounds = 10;
+	std::mt19937 rng(500 + id);
+	Sizes sizes = UniformSizes(kSizeCount, 16, 1024, 600 + id);
+
+	std::vector<void*>& mine = shared.slots[id];
+	mine.resize(kSlots);
+	for (std::size_t i = 0; i < kSlots; ++i)
+		mine[i] = ctx.Alloc(sizes[i]);
 
-	for (auto& t : threads)
+	std::size_t k = 0;
+	for (std::size_t round = 0; round < kRounds; ++round)
 	{
+		shared.barrier.Wait();
+		std::vector<void*>& slots = shared.slots[(id + round) % threads];
+		for (std::size_t i = 0; i < ops / kRounds / 2; ++i)
+		{
+			void*& ptr = slots[rng() % kSlots];
+			ctx.Dealloc(ptr);
+			ptr = ctx.Alloc(sizes[++k % sizes.size()]);
+		}
+	}
+	shared.barrier.Wait();
+
+	for (void* ptr : shared.slots[(id + kRounds - 1) % threads])
+		ctx.Dealloc(ptr);
+}
+
+// 模拟不断追加的日志缓冲区与增长的vector: 随机选一个缓冲区扩大，达到上限后释放重来
+static void ReallocWorkload(Context& ctx, Shared&, int id, int, std::size_t ops)
+{
+	const std::size_t kBuffers = 16;
+	std::mt19937 rng(700 + id);
+	Sizes limits = UniformSizes(kSizeCount, 4096, 1 << 20, 800 + id);
+
+	void* ptrs[kBuffers] = {};
+	std::size_t bytes[kBuffers] = {};
+	std::size_t k = 0;
+	while (ctx.ops < ops)
+	{
+		std::size_t i = rng() % kBuffers;
+		if (bytes[i] >= limits[i])
+		{
+			ctx.Dealloc(ptrs[i]);
+			ptrs[i] = nullptr;
+			bytes[i] = 0;
+			limits[i] = limits[++k % limits.size()];
+		}
+
+		// 前一半缓冲区每次追加1~256字节，后一半像vector一样按1.5倍增长
+		std::size_t grow = i < kBuffers / 2 || bytes[i] < 64 ? rng() % 256 + 1 : bytes[i] / 2;
+		bytes[i] += grow;
+		ptrs[i] = ctx.Realloc(ptrs[i], bytes[i]);
+	}
+	for (void* ptr : ptrs)
+	{
+		if (ptr != nullptr)
+			ctx.Dealloc(ptr);
+	}
+}
+
+static const Workload kWorkloads[] = {
+	{ "tiny", 4000000, TinyWorkload },
+	{ "uniform", 1000000, UniformWorkload },
+	{ "lognormal", 2000000, LogNormalWorkload },
+	{ "large", 200000, LargeWorkload },
+	{ "prodcons", 2000000, ProducerConsumerWorkload },
+	{ "larson", 2000000, LarsonWorkload },
+	{ "realloc", 200000, ReallocWorkload },
+};
+
+// 一遍运行的结果
+struct RunResult
+{
+	double wallNs = 0;
+	std::size_t ops = 0;
+	Histogram hist;
+	Histogram freeHist;
+	// 所有线程的硬件计数之和，负数表示不可用
+	double counters[PerfCounters::kEvents] = {};
+};
+
+// 用threads个线程运行一遍负载
+// timed时逐次计时，pinned时将线程绑定到核上并读取硬件计数器
+static void RunOnce(const Workload& workload, const Allocator& allocator, int threads, bool timed, bool pinned,
+	RunResult& result)
+{
+	Shared shared(threads);
+	std::vector<Context> contexts(threads);
+	std::vector<std::thread> workers;
+	std::atomic<int> ready{ 0 };
+	std::atomic<bool> start{ false };
+	std::mutex counterMtx;
+
+	for (int i = 0; i < threads; ++i)
+	{
+		contexts[i].allocator = &allocator;
+		contexts[i].timed = timed;
+		workers.emplace_back([&, i]() {
+			if (pinned)
+				PinThread(i);
+			PerfCounters counters;
+
+			ready.fetch_add(1);
+			while (!start.load(std::memory_order_acquire))
+				std::this_thread::yield();
+
+			counters.Start();
+			workload.run(contexts[i], shared, i, threads, workload.ops);
+			if (pinned)
+			{
+				std::unique_lock<std::mutex> lk(counterMtx);
+				counters.Stop(result.counters);
+			}
+		});
+	}
+
+	while (ready.load() != threads)
+		std::this_thread::yield();
+	auto begin = std::chrono::steady_clock::now();
+	start.store(true, std::memory_order_release);
+	for (std::thread& t : workers)
 		t.join();
+	auto end = std::chrono::steady_clock::now();
+
+	for (Context& ctx : contexts)
+	{
+		result.ops += ctx.ops;
+		result.hist.Merge(ctx.hist);
+		result.freeHist.Merge(ctx.freeHist);
 	}
+	result.wallNs = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count();
+}
 
+// 是否运行名为name的负载，names为空时运行全部
+static bool Selected(const char* name, char* names[], int count)
+{
+	bool selected = count == 0;
+	for (int i = 0; i < count; ++i)
+		selected = selected || strcmp(names[i], name) == 0;
+	return selected;
+}
+
+// 对比两个分配器的吞吐量与延迟
+static void Compare(int threads, char* names[], int count)
+{
+	double cyclesPerNs = CyclesPerNs();
+
+	printf("threads: %d, ns/op = wall time / ops per thread, latency in ns, free = mean cycles per free\n", threads);
+	printf("%-10s %-7s %10s %9s %9s %8s %8s %8s %8s %8s\n",
+		"workload", "alloc", "ops", "wall ms", "Mops/s", "ns/op", "p50", "p99", "p999", "free");
+
+	for (const Workload& workload : kWorkloads)
+	{
+		if (!Selected(workload.name, names, count))
+			continue;
 
-	printf("%u个线程并发执行%u轮次, 每轮次ConcurrentAlloc%u次, 花费: %u ms\n", works, rounds, times, int(tcAllocCost));
-	printf("                      , 每轮次ConcurrentDealloc%u次, 花费: %u ms\n", times, int(tcDeallocCost));
-	printf("                      , 共花费: %u ms\n\n", int(tcCost));
+		for (const Allocator& allocator : kAllocators)
+		{
+			RunResult run, timed;
+			RunOnce(workload, allocator, threads, false, false, run);
+			RunOnce(workload, allocator, threads, true, false, timed);
 
-	printf("%u个线程并发执行%u轮次, 每轮次malloc%u次, 花费: %u ms\n", works, rounds, times, int(allocCost));
-	printf("                      , 每轮次free%u次, 花费: %u ms\n", times, int(deallocCost));
-	printf("                      , 共花费: %u ms\n", int(cost));
+			printf("%-10s %-7s %10zu %9.1f %9.2f %8.1f %8.0f %8.0f %8.0f %8.1f\n",
+				workload.name, allocator.name, run.ops, run.wallNs / 1e6, run.ops / run.wallNs * 1e3,
+				run.wallNs * threads / run.ops,
+				timed.hist.Percentile(0.5) / cyclesPerNs,
+				timed.hist.Percentile(0.99) / cyclesPerNs,
+				timed.hist.Percentile(0.999) / cyclesPerNs,
+				timed.freeHist.Mean());
+		}
+	}
+}
+
+// 线程数从1倍增到maxThreads，输出CSV
+// 内存池的每层各有一组指标，每千次操作的次数:
+//   thread cache未命中: 向central cache申请与归还的次数
+//   central cache: 各桶SpanList锁的加锁与等待次数
+//   page cache: _pageMtx的加锁与等待次数
+// 随线程数增加，等待次数最先上升的那一层即为瓶颈
+static void Sweep(int maxThreads, char* names[], int count)
+{
+	printf("workload,allocator,threads,ops,wall_ms,mops,ns_per_op");
+	for (int i = 0; i < PerfCounters::kEvents; ++i)
+		printf(",%s_per_op", PerfCounters::Name(i));
+	printf(",thread_misses_per_kop,central_locks_per_kop,central_waits_per_kop"
+		",page_locks_per_kop,page_waits_per_kop,bottleneck\n");
+
+	for (const Workload& workload : kWorkloads)
+	{
+		if (!Selected(workload.name, names, count))
+			continue;
+
+		for (int threads = 1; ; threads = (std::min)(threads * 2, maxThreads))
+		{
+			for (const Allocator& allocator : kAllocators)
+			{
+				PoolStats before = ConcurrentGetStats();
+				RunResult run;
+				RunOnce(workload, allocator, threads, false, true, run);
+				PoolStats after = ConcurrentGetStats();
+
+				printf("%s,%s,%d,%zu,%.2f,%.3f,%.2f", workload.name, allocator.name, threads, run.ops,
+					run.wallNs / 1e6, run.ops / run.wallNs * 1e3, run.wallNs * threads / run.ops);
+				for (double value : run.counters)
+				{
+					if (value < 0)
+						printf(",");
+					else
+						printf(",%.3f", value / run.ops);
+				}
+
+				if (&allocator != &kAllocators[0])
+				{
+					printf(",,,,,,\n");
+					continue;
+				}
+
+				// 只统计本次运行期间的增量
+				double misses = 0, centralLocks = 0, centralWaits = 0;
+				for (std::size_t i = 0; i < kNFreeList; ++i)
+				{
+					const ClassStats& a = after.classes[i];
+					const ClassStats& b = before.classes[i];
+					misses += (a.fetch_count - b.fetch_count) + (a.release_count - b.release_count);
+					centralLocks += a.lock_acquisitions - b.lock_acquisitions;
+					centralWaits += a.lock_contentions - b.lock_contentions;
+				}
+				double pageLocks = (double)(after.page_lock_acquisitions - before.page_lock_acquisitions);
+				double pageWaits = (double)(after.page_lock_contentions - before.page_lock_contentions);
+
+				// 有等待时取等待较多的一层，否则操作主要在thread cache内完成
+				const char* bottleneck = "thread";
+				if (centralWaits > 0 || pageWaits > 0)
+					bottleneck = pageWaits > centralWaits ? "page" : "central";
+
+				double kops = run.ops / 1000.0;
+				printf(",%.3f,%.3f,%.3f,%.3f,%.3f,%s\n", misses / kops, centralLocks / kops, centralWaits / kops,
+					pageLocks / kops, pageWaits / kops, bottleneck);
+			}
+			fflush(stdout);
+
+			if (threads == maxThreads)
+				break;
+		}
+	}
 }
 
-int main()
+int main(int argc, char* argv[])
 {
-	BenchMarkTest(100, 4, 2560);
+	if (argc > 2 && strcmp(argv[1], "--sweep") == 0)
+	{
+		Sweep((std::max)(atoi(argv[2]), 1), argv + 3, argc - 3);
+		return 0;
+	}
+
+	int threads = 4;
+	if (argc > 1)
+		threads = (std::max)(atoi(argv[1]), 1);
+	Compare(threads, argv + 2, (std::max)(argc - 2, 0));
 	return 0;
-}
\ No newline at end of file
+}
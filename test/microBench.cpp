@@ -0,0 +1,284 @@
+#include "../concurrentPool.h"
+#include <thread>
+#include <atomic>
+
+#include <vector>
+#include <map>
+#include <list>
+#include <unordered_map>
+#include <chrono>
+#include <random>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// 读取时间戳计数器，非x86平台退化为纳秒
+static inline unsigned long long ReadCycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// 比较ConcurrentDealloc(ptr)与ConcurrentDealloc(ptr, size)每次释放的周期数
+void SizedDeallocBenchMark(int rounds, int times)
+{
+	std::vector<void*> ptrs(times);
+	std::vector<std::size_t> sizes(times);
+	std::vector<int> order(times);
+
+	std::mt19937 rng(42);
+	for (int i = 0; i < times; ++i)
+	{
+		sizes[i] = rng() % 1024 + 1;
+		order[i] = i;
+	}
+	// 打乱释放顺序，使PageMap的访问分散
+	std::shuffle(order.begin(), order.end(), rng);
+
+	unsigned long long unsizedCycles = 0, sizedCycles = 0;
+	for (int j = 0; j < rounds; ++j)
+	{
+		for (int i = 0; i < times; ++i)
+			ptrs[i] = ConcurrentAlloc(sizes[i]);
+
+		unsigned long long begin1 = ReadCycles();
+		for (int i = 0; i < times; ++i)
+			ConcurrentDealloc(ptrs[order[i]]);
+		unsigned long long end1 = ReadCycles();
+
+		for (int i = 0; i < times; ++i)
+			ptrs[i] = ConcurrentAlloc(sizes[i]);
+
+		unsigned long long begin2 = ReadCycles();
+		for (int i = 0; i < times; ++i)
+			ConcurrentDealloc(ptrs[order[i]], sizes[order[i]]);
+		unsigned long long end2 = ReadCycles();
+
+		unsizedCycles += end1 - begin1;
+		sizedCycles += end2 - begin2;
+	}
+
+	double total = (double)rounds * times;
+	printf("%d轮次, 每轮次释放%d个[1,1024]字节的对象\n", rounds, times);
+	printf("ConcurrentDealloc(ptr)      : %.1f cycles/free\n", unsizedCycles / total);
+	printf("ConcurrentDealloc(ptr, size): %.1f cycles/free\n", sizedCycles / total);
+	printf("每次释放节省: %.1f cycles\n\n", (unsizedCycles - (double)sizedCycles) / total);
+}
+
+// 模拟追加写的日志缓冲区，每次增长step字节直到maxBytes
+// 比较ConcurrentRealloc与申请新内存、复制后释放旧内存的开销
+void ReallocBenchMark(int rounds, std::size_t step, std::size_t maxBytes)
+{
+	unsigned long long reallocCycles = 0, copyCycles = 0;
+	for (int j = 0; j < rounds; ++j)
+	{
+		unsigned long long begin1 = ReadCycles();
+		char* buf = nullptr;
+		for (std::size_t size = step; size <= maxBytes; size += step)
+		{
+			buf = (char*)ConcurrentRealloc(buf, size);
+			buf[size - 1] = 1;
+		}
+		ConcurrentDealloc(buf);
+		unsigned long long end1 = ReadCycles();
+
+		unsigned long long begin2 = ReadCycles();
+		buf = nullptr;
+		for (std::size_t size = step; size <= maxBytes; size += step)
+		{
+			char* newBuf = (char*)ConcurrentAlloc(size);
+			if (buf != nullptr)
+			{
+				memcpy(newBuf, buf, size - step);
+				ConcurrentDealloc(buf);
+			}
+			buf = newBuf;
+			buf[size - 1] = 1;
+		}
+		ConcurrentDealloc(buf);
+		unsigned long long end2 = ReadCycles();
+
+		reallocCycles += end1 - begin1;
+		copyCycles += end2 - begin2;
+	}
+
+	double total = (double)rounds * (maxBytes / step);
+	printf("%d轮次, 每轮次以%zu字节为步长增长到%zuKB\n", rounds, step, maxBytes / 1024);
+	printf("ConcurrentRealloc          : %.1f cycles/op\n", reallocCycles / total);
+	printf("ConcurrentAlloc+memcpy+Dealloc: %.1f cycles/op\n\n", copyCycles / total);
+}
+
+// 先持有大量存活的小对象，使central cache中积累大量内存块已全部分出的span
+// 再测量申请延迟，其中thread cache为空时需向central cache获取
+void LiveObjectsFetchBenchMark(int live, int probes)
+{
+	const std::size_t kBytes = 16;
+	std::vector<void*> held(live);
+	for (int i = 0; i < live; ++i)
+		held[i] = ConcurrentAlloc(kBytes);
+
+	std::vector<void*> ptrs(probes);
+	unsigned long long cycles = 0;
+	for (int i = 0; i < probes; ++i)
+	{
+		unsigned long long begin = ReadCycles();
+		ptrs[i] = ConcurrentAlloc(kBytes);
+		unsigned long long end = ReadCycles();
+		cycles += end - begin;
+	}
+
+	printf("持有%d个存活的%zu字节对象, 之后申请%d次: %.1f cycles/alloc\n\n",
+		live, kBytes, probes, (double)cycles / probes);
+
+	for (int i = 0; i < probes; ++i)
+		ConcurrentDealloc(ptrs[i], kBytes);
+	for (int i = 0; i < live; ++i)
+		ConcurrentDealloc(held[i], kBytes);
+}
+
+// 在大量小对象间随机跳转访问，TLB未命中占主要开销
+// 分别以默认方式和FLAGS=-DCONCURRENT_POOL_HUGEPAGE编译后比较
+void TlbBenchMark(int objects, int steps)
+{
+	const std::size_t kBytes = 256;
+	std::vector<std::size_t*> ptrs(objects);
+	for (int i = 0; i < objects; ++i)
+		ptrs[i] = (std::size_t*)ConcurrentAlloc(kBytes);
+
+	// 每个对象中存放随机排列中下一个对象的地址，形成一个环
+	std::vector<int> order(objects);
+	for (int i = 0; i < objects; ++i)
+		order[i] = i;
+	std::shuffle(order.begin(), order.end(), std::mt19937(42));
+	for (int i = 0; i < objects; ++i)
+		*ptrs[order[i]] = (std::size_t)ptrs[order[(i + 1) % objects]];
+
+	std::size_t* cur = ptrs[order[0]];
+	auto begin = std::chrono::steady_clock::now();
+	for (int i = 0; i < steps; ++i)
+		cur = (std::size_t*)*cur;
+	auto end = std::chrono::steady_clock::now();
+
+	double ns = std::chrono::duration<double, std::nano>(end - begin).count();
+#ifdef CONCURRENT_POOL_HUGEPAGE
+	const char* mode = "大页模式";
+#else
+	const char* mode = "普通模式";
+#endif
+	printf("%s: %d个%zu字节对象间随机访问%d次: %.1f ns/access, 大页映射%zuMB (%p)\n\n", mode, objects, kBytes, steps,
+		ns / steps, PageCache::GetInstance().HugePageBackedBytes() >> 20, (void*)cur);
+
+	for (int i = 0; i < objects; ++i)
+		ConcurrentDealloc(ptrs[i], kBytes);
+}
+
+// 容器的申请释放几乎全是固定大小的节点，按三种方式比较同样操作每次的周期数
+// std::allocator(经由全局new)、PoolAllocator、以ConcurrentMemoryResource构造的pmr容器
+template <class Map>
+static double MapChurn(Map& m, int keys, int ops)
+{
+	std::mt19937 rng(42);
+	for (int i = 0; i < keys; ++i)
+		m.emplace(rng() % (keys * 2), i);
+
+	// 插入与删除交替，容器大小大致不变，节点不断申请释放
+	unsigned long long begin = ReadCycles();
+	for (int i = 0; i < ops; ++i)
+	{
+		int key = rng() % (keys * 2);
+		auto it = m.find(key);
+		if (it == m.end())
+			m.emplace(key, i);
+		else
+			m.erase(it);
+	}
+	unsigned long long end = ReadCycles();
+	return (double)(end - begin) / ops;
+}
+
+template <class Vector>
+static double VectorGrowth(Vector& v, int rounds, int elements)
+{
+	unsigned long long begin = ReadCycles();
+	for (int j = 0; j < rounds; ++j)
+	{
+		v.clear();
+		v.shrink_to_fit();
+		for (int i = 0; i < elements; ++i)
+			v.push_back(i);
+	}
+	unsigned long long end = ReadCycles();
+	return (double)(end - begin) / ((double)rounds * elements);
+}
+
+template <class List>
+static double ListChurn(List& l, int rounds, int elements)
+{
+	unsigned long long begin = ReadCycles();
+	for (int j = 0; j < rounds; ++j)
+	{
+		for (int i = 0; i < elements; ++i)
+			l.push_back(i);
+		// 先删除一半，打乱空闲链表中节点的顺序
+		for (auto it = l.begin(); it != l.end(); )
+			it = (*it & 1) ? l.erase(it) : std::next(it);
+		l.clear();
+	}
+	unsigned long long end = ReadCycles();
+	return (double)(end - begin) / ((double)rounds * elements);
+}
+
+void ContainerBenchMark(int keys, int ops)
+{
+	using Node = std::pair<const int, int>;
+	std::pmr::memory_resource* mr = ConcurrentMemoryResource();
+
+	printf("容器基准, %d个key, %d次操作 (cycles/op)\n", keys, ops);
+	printf("%-24s %14s %14s %14s\n", "", "std", "PoolAllocator", "pmr");
+	{
+		std::map<int, int> a;
+		std::map<int, int, std::less<int>, PoolAllocator<Node>> b;
+		std::pmr::map<int, int> c(mr);
+		double x = MapChurn(a, keys, ops), y = MapChurn(b, keys, ops), z = MapChurn(c, keys, ops);
+		printf("%-24s %14.1f %14.1f %14.1f\n", "map insert/erase", x, y, z);
+	}
+	{
+		std::unordered_map<int, int> a;
+		std::unordered_map<int, int, std::hash<int>, std::equal_to<int>, PoolAllocator<Node>> b;
+		std::pmr::unordered_map<int, int> c(mr);
+		double x = MapChurn(a, keys, ops), y = MapChurn(b, keys, ops), z = MapChurn(c, keys, ops);
+		printf("%-24s %14.1f %14.1f %14.1f\n", "unordered_map churn", x, y, z);
+	}
+	{
+		std::vector<int> a;
+		std::vector<int, PoolAllocator<int>> b;
+		std::pmr::vector<int> c(mr);
+		int rounds = (std::max)(ops / keys, 1);
+		double x = VectorGrowth(a, rounds, keys), y = VectorGrowth(b, rounds, keys), z = VectorGrowth(c, rounds, keys);
+		printf("%-24s %14.1f %14.1f %14.1f\n", "vector push_back", x, y, z);
+	}
+	{
+		std::list<int> a;
+		std::list<int, PoolAllocator<int>> b;
+		std::pmr::list<int> c(mr);
+		int rounds = (std::max)(ops / keys, 1);
+		double x = ListChurn(a, rounds, keys), y = ListChurn(b, rounds, keys), z = ListChurn(c, rounds, keys);
+		printf("%-24s %14.1f %14.1f %14.1f\n", "list push/erase", x, y, z);
+	}
+	printf("\n");
+}
+
+int main()
+{
+	TlbBenchMark(1 << 20, 20000000);
+	LiveObjectsFetchBenchMark(4000000, 1000000);
+	SizedDeallocBenchMark(10, 1000000);
+	ReallocBenchMark(3, 4096, 2 * 1024 * 1024);
+	ContainerBenchMark(100000, 2000000);
+	return 0;
+}
\ No newline at end of file
@@ -0,0 +1,48 @@
+#include <cassert>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+#include <iostream>
+
+#include "../concurrentPool.h"
+
+// 通过LD_PRELOAD替换malloc/free后运行: LD_PRELOAD=../libconcurrentPool.so ./preloadTest
+// 链接libconcurrentPool.so只为调用ConcurrentGetStats，申请释放经过被替换的malloc/free
+
+using std::cout;
+using std::endl;
+
+// 线程退出时glibc在TLS析构之后释放析构函数链表的节点，不应为此重新创建thread cache
+void ThreadExitTest()
+{
+	const int kThreads = 1600;
+
+	PoolStats before = ConcurrentGetStats();
+	for (int i = 0; i < kThreads; ++i)
+	{
+		std::thread([]() {
+			// 有析构函数的thread_local对象使glibc在退出时申请并释放链表节点
+			thread_local std::vector<int> local(16);
+			void* ptr = malloc(100);
+			local[0] = 1;
+			free(ptr);
+		}).join();
+	}
+	PoolStats after = ConcurrentGetStats();
+
+	// 所有线程都已退出，存活的thread cache不应增加
+	assert(after.thread_caches <= before.thread_caches + 1);
+	assert(after.thread_cache_claimed_budget <= after.thread_cache_budget);
+	cout << "ThreadExitTest: " << after.thread_caches << " caches after " << kThreads << " threads" << endl;
+}
+
+int main()
+{
+	// 确认malloc确实被替换
+	void* ptr = malloc(100);
+	assert(ConcurrentUsableSize(ptr) >= 100);
+	free(ptr);
+
+	ThreadExitTest();
+	return 0;
+}
@@ -1,9 +1,17 @@
 #include <vector>
+#include <map>
+#include <string>
+#include <unordered_map>
 #include <ctime>
 #include <thread>
+#include <chrono>
 
 #include "../concurrentPool.h"
 
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
 struct A
 {
 	int val = 10;
@@ -260,8 +268,815 @@ void MultiThreadTest()
 	}
 }
 
+// 返回当前进程的常驻内存大小(字节)
+std::size_t ResidentBytes()
+{
+#ifdef __linux__
+	std::size_t total = 0, resident = 0;
+	FILE* fp = fopen("/proc/self/statm", "r");
+	if (fp != nullptr)
+	{
+		if (fscanf(fp, "%zu %zu", &total, &resident) != 2)
+			resident = 0;
+		fclose(fp);
+	}
+	return resident * sysconf(_SC_PAGESIZE);
+#else
+	return 0;
+#endif
+}
+
+// 反复创建并回收大量线程，每个线程退出时thread cache中的内存应被归还，内存保持平稳
+void ThreadExitTest()
+{
+	const int kRounds = 250;
+	const int kThreads = 16;
+	const int kObjects = 256;
+
+	auto work = []() {
+		std::vector<void*> ptrs(kObjects);
+		for (int i = 0; i < kObjects; ++i)
+		{
+			ptrs[i] = ConcurrentAlloc((i % 64 + 1) * 16);
+		}
+		for (int i = 0; i < kObjects; ++i)
+		{
+			ConcurrentDealloc(ptrs[i]);
+		}
+	};
+
+	std::size_t warm = 0;
+	for (int j = 0; j < kRounds; ++j)
+	{
+		std::vector<std::thread> vt(kThreads);
+		for (auto& t : vt)
+			t = std::thread(work);
+		for (auto& t : vt)
+			t.join();
+
+		if (j == kRounds / 4)
+			warm = ResidentBytes();
+	}
+
+	std::size_t end = ResidentBytes();
+	cout << "ThreadExitTest: " << kRounds * kThreads << " threads, rss "
+		<< warm / 1024 << "KB -> " << end / 1024 << "KB" << endl;
+	assert(end < warm + 32 * 1024 * 1024);
+}
+
+// 释放后page cache中的空闲内存应能归还系统，再次申请时重新提交
+void ScavengeTest()
+{
+	const int kObjects = 256;
+	const std::size_t kBytes = 100 * 1024;
+	PageCache& pageCache = PageCache::GetInstance();
+
+	std::vector<void*> ptrs(kObjects);
+	for (int i = 0; i < kObjects; ++i)
+	{
+		ptrs[i] = ConcurrentAlloc(kBytes);
+		memset(ptrs[i], 0xff, kBytes);
+	}
+	for (int i = 0; i < kObjects; ++i)
+	{
+		ConcurrentDealloc(ptrs[i]);
+	}
+
+	std::size_t before = ResidentBytes();
+	std::size_t released = ConcurrentReleaseMemory(SIZE_MAX);
+	std::size_t after = ResidentBytes();
+	cout << "ScavengeTest: released " << released / 1024 << "KB, rss "
+		<< before / 1024 << "KB -> " << after / 1024 << "KB" << endl;
+	assert(released >= kObjects * kBytes);
+	assert(pageCache.ReturnedBytes() >= kObjects * kBytes);
+#ifdef __linux__
+	assert(after + kObjects * kBytes / 2 < before);
+#endif
+
+	// 重新使用已归还的内存
+	for (int i = 0; i < kObjects; ++i)
+	{
+		ptrs[i] = ConcurrentAlloc(kBytes);
+		memset(ptrs[i], 0xff, kBytes);
+	}
+	assert(pageCache.ReturnedBytes() < kObjects * kBytes);
+	for (int i = 0; i < kObjects; ++i)
+	{
+		ConcurrentDealloc(ptrs[i]);
+	}
+
+	// 后台线程归还空闲的内存
+	ConcurrentStartScavenger(0, 1024 * 1024 * 1024);
+	std::this_thread::sleep_for(std::chrono::milliseconds(500));
+	ConcurrentStopScavenger();
+	assert(pageCache.ReturnedBytes() >= kObjects * kBytes);
+}
+
+// 大页模式下已归还与未归还的span合并后，每页只归还和计数一次
+void HugePageReturnTest()
+{
+#ifdef CONCURRENT_POOL_HUGEPAGE
+	const std::size_t kBytes = 100 * 1024;
+	PageCache& pageCache = PageCache::GetInstance();
+
+	// 完整的空闲大页全部归还系统，之后的申请从已归还的大页中切出
+	ConcurrentReleaseMemory(SIZE_MAX);
+
+	// 找到一块紧跟着已归还的空闲span的内存
+	std::vector<void*> ptrs;
+	Span* span = nullptr;
+	for (int i = 0; i < 1000 && span == nullptr; ++i)
+	{
+		ptrs.push_back(ConcurrentAlloc(kBytes));
+		Span* cur = PageCache::_idSpanMap.get((std::size_t)ptrs.back() >> kPageShift);
+		Span* next = PageCache::_idSpanMap.get(cur->page_id + cur->page_num);
+		if (next != nullptr && !next->is_used && next->is_returned)
+			span = cur;
+	}
+	assert(span != nullptr);
+
+	// 释放后与已归还的span合并，释放的页随之归还并计数，原已归还的页不再重复计数
+	std::size_t bytes = span->page_num << kPageShift;
+	std::size_t before = pageCache.ReturnedBytes();
+	ConcurrentDealloc(ptrs.back());
+	ptrs.pop_back();
+	assert(pageCache.ReturnedBytes() == before + bytes);
+
+	// 合并后的span已归还，不会被再次归还
+	before = pageCache.ReturnedBytes();
+	std::size_t released = ConcurrentReleaseMemory(SIZE_MAX);
+	assert(pageCache.ReturnedBytes() == before + released);
+
+	for (void* ptr : ptrs)
+	{
+		ConcurrentDealloc(ptr);
+	}
+#endif
+	cout << "HugePageReturnTest: ok" << endl;
+}
+
+// 各种对齐和大小组合，检查首地址对齐且内存可用
+void AlignedAllocTest()
+{
+	std::vector<void*> ptrs;
+	for (std::size_t align = 8; align <= (std::size_t(1) << 21); align <<= 1)
+	{
+		for (std::size_t bytes : { std::size_t(1), std::size_t(24), std::size_t(100), std::size_t(3000),
+			std::size_t(20000), std::size_t(70000), std::size_t(300000) })
+		{
+			for (int i = 0; i < 3; ++i)
+			{
+				void* ptr = ConcurrentAlignedAlloc(bytes, align);
+				assert((std::size_t)ptr % align == 0);
+				assert(ConcurrentUsableSize(ptr) >= bytes);
+				memset(ptr, 0xff, bytes);
+				ptrs.push_back(ptr);
+			}
+		}
+	}
+
+	// 常用的小对齐不需要额外的空间
+	assert(SizeClass::ClassSize(SizeClass::AlignedIndex(64, 64)) == 64);
+	assert(SizeClass::ClassSize(SizeClass::AlignedIndex(4096, 4096)) == 4096);
+
+	for (void* ptr : ptrs)
+	{
+		ConcurrentDealloc(ptr);
+	}
+	cout << "AlignedAllocTest: " << ptrs.size() << " allocations" << endl;
+}
+
+// 同一个桶内原地返回，大对象原地扩展或重新映射，内容保持不变
+void ReallocTest()
+{
+	char* p = (char*)ConcurrentAlloc(100);
+	memset(p, 1, 100);
+	assert(ConcurrentRealloc(p, 104) == p);
+
+	// 逐步增长到数MB，覆盖小对象、page cache中的span与直接向系统申请的span
+	std::size_t size = 100;
+	while (size < 8 * 1024 * 1024)
+	{
+		std::size_t newSize = size * 3 / 2;
+		p = (char*)ConcurrentRealloc(p, newSize);
+		memset(p + size, (int)(newSize & 0x7f), newSize - size);
+		for (std::size_t i = 0; i < newSize; i += 997)
+		{
+			assert(p[i] != 0);
+		}
+		size = newSize;
+	}
+	assert(ConcurrentUsableSize(p) >= size);
+
+	// 缩小后内容保持不变
+	char c = p[100 * 1024 - 1];
+	p = (char*)ConcurrentRealloc(p, 100 * 1024);
+	assert(p[100 * 1024 - 1] == c);
+	p = (char*)ConcurrentRealloc(p, 1000);
+	assert(p[0] == 1 && p[99] == 1);
+	ConcurrentDealloc(p);
+
+	// 页缓存中的span紧邻空闲页时原地扩展
+	// 先原地缩小，切下的尾部成为紧邻的空闲span，再扩大时并入
+	const std::size_t kHeapBytes = 400 * 1024;
+	static_assert(kHeapBytes < ((kNPageList - 1) << kPageShift), "must be served by the page heap");
+	void* big = ConcurrentAlloc(kHeapBytes);
+	void* shrunk = ConcurrentRealloc(big, kHeapBytes / 2);
+	assert(shrunk == big);
+	void* grown = ConcurrentRealloc(shrunk, kHeapBytes);
+	assert(grown == big && ConcurrentUsableSize(grown) == kHeapBytes);
+	ConcurrentDealloc(grown);
+
+	// 超过page cache最大页数的span通过mremap调整，地址可能改变，内容保持不变
+	const std::size_t kDirectBytes = 4 * ((kNPageList - 1) << kPageShift);
+	unsigned char* direct = (unsigned char*)ConcurrentAlloc(kDirectBytes);
+	for (std::size_t i = 0; i < kDirectBytes; i += 4096)
+	{
+		direct[i] = (unsigned char)(i / 4096);
+	}
+	direct = (unsigned char*)ConcurrentRealloc(direct, 2 * kDirectBytes);
+	assert(ConcurrentUsableSize(direct) == 2 * kDirectBytes);
+	for (std::size_t i = 0; i < kDirectBytes; i += 4096)
+	{
+		assert(direct[i] == (unsigned char)(i / 4096));
+	}
+	memset(direct + kDirectBytes, 1, kDirectBytes);
+	ConcurrentDealloc(direct);
+	cout << "ReallocTest: ok" << endl;
+}
+
+// 统计的计数与各层缓存的字节数
+void StatsTest()
+{
+	const int kObjects = 1000;
+	const std::size_t kBytes = 100;
+	std::size_t index = SizeClass::Index(kBytes);
+
+	PoolStats before = ConcurrentGetStats();
+	std::vector<void*> ptrs(kObjects);
+	for (int i = 0; i < kObjects; ++i)
+	{
+		ptrs[i] = ConcurrentAlloc(kBytes);
+	}
+	void* large = ConcurrentAlloc(1024 * 1024);
+	PoolStats middle = ConcurrentGetStats();
+
+	for (int i = 0; i < kObjects; ++i)
+	{
+		ConcurrentDealloc(ptrs[i]);
+	}
+	ConcurrentDealloc(large);
+	PoolStats after = ConcurrentGetStats();
+
+	const ClassStats& cls = after.classes[index];
+	assert(cls.size == SizeClass::ClassSize(index));
+	assert(middle.classes[index].span_bytes >= kObjects * cls.size);
+#ifndef CONCURRENT_POOL_NO_STATS
+	assert(cls.alloc_count - before.classes[index].alloc_count == kObjects);
+	assert(cls.free_count - before.classes[index].free_count == kObjects);
+	assert(cls.fetch_objects >= kObjects);
+	assert(after.large_alloc_count - before.large_alloc_count == 1);
+	assert(after.large_free_count - before.large_free_count == 1);
+	// 1000个对象需要多次向central cache申请，每次加一次锁；大对象直接经过page cache
+	assert(middle.classes[index].lock_acquisitions > before.classes[index].lock_acquisitions);
+	assert(after.page_lock_acquisitions > before.page_lock_acquisitions);
+	// 释放后的内存块留在thread cache中、已归还central cache，或所在的span已整个归还page cache
+	std::size_t returnedSpanBytes = middle.classes[index].span_bytes - (std::min)(middle.classes[index].span_bytes, cls.span_bytes);
+	assert(cls.thread_cache_bytes + cls.transfer_cache_bytes + cls.central_cache_bytes + returnedSpanBytes >= kObjects * cls.size);
+#endif
+
+	// 所有缓存的内存和元数据都来自系统
+	std::size_t mapped = after.system_alloc_bytes - after.system_dealloc_bytes;
+	std::size_t spanBytes = 0;
+	for (const ClassStats& c : after.classes)
+	{
+		spanBytes += c.span_bytes;
+	}
+	assert(spanBytes + after.page_heap_free_bytes + after.page_map_bytes <= mapped);
+	assert(after.span_metadata_bytes > 0 && after.page_map_bytes > 0);
+#ifdef CONCURRENT_POOL_SPAN_BITMAP
+	assert(after.span_metadata_bytes >= SpanPool::MemoryBytes() + SpanBitmapPool::MemoryBytes());
+#endif
+
+	FILE* fp = tmpfile();
+	ConcurrentDumpStats(fp);
+	assert(ftell(fp) > 0);
+	fclose(fp);
+	cout << "StatsTest: mapped " << mapped / 1024 << "KB, metadata "
+		<< (after.span_metadata_bytes + after.thread_cache_metadata_bytes + after.page_map_bytes) / 1024 << "KB" << endl;
+}
+
+// 返回profile中采样的数量
+static std::size_t ProfiledObjects()
+{
+	FILE* fp = tmpfile();
+	ConcurrentDumpHeapProfile(fp);
+	rewind(fp);
+
+	std::size_t objects = 0, bytes = 0, rate = 0, unused = 0;
+	int n = fscanf(fp, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu", &objects, &bytes, &unused, &unused, &rate);
+	assert(n == 5);
+	fclose(fp);
+	return objects;
+}
+
+#ifdef __linux__
+// 第一次写入时释放cookie中的所有内存块，其中有被采样的，输出期间须能删除采样
+static ssize_t FreeOnWrite(void* cookie, const char*, size_t size)
+{
+	std::vector<void*>& ptrs = *(std::vector<void*>*)cookie;
+	for (void* ptr : ptrs)
+	{
+		ConcurrentDealloc(ptr, 1000);
+	}
+	ptrs.clear();
+	return size;
+}
+#endif
+
+// 采样数量与申请的字节数成正比，释放后采样被删除
+void ProfileTest()
+{
+	const int kObjects = 10000;
+	const std::size_t kBytes = 1000;
+	const std::size_t kRate = 64 * 1024;
+
+	ConcurrentSetProfileSampleRate(kRate);
+	std::vector<void*> ptrs(kObjects);
+	for (int i = 0; i < kObjects; ++i)
+	{
+		ptrs[i] = ConcurrentAlloc(kBytes);
+	}
+
+	// 期望约为kObjects * kBytes / kRate = 152个
+	std::size_t objects = ProfiledObjects();
+	cout << "ProfileTest: " << objects << " samples" << endl;
+	assert(objects > 50 && objects < 400);
+
+#ifdef __linux__
+	// 由输出流释放被采样的内存
+	static_assert(kBytes == 1000, "FreeOnWrite frees 1000-byte objects");
+	cookie_io_functions_t io = { nullptr, FreeOnWrite, nullptr, nullptr };
+	FILE* fp = fopencookie(&ptrs, "w", io);
+	ConcurrentDumpHeapProfile(fp);
+	fclose(fp);
+	assert(ptrs.empty());
+#else
+	for (int i = 0; i < kObjects; ++i)
+	{
+		ConcurrentDealloc(ptrs[i], kBytes);
+	}
+#endif
+	assert(ProfiledObjects() == 0);
+	ConcurrentSetProfileSampleRate(0);
+}
+
+// 主线程申请、另一个线程释放，主线程再次申请时应取回这些内存块
+void RemoteFreeTest()
+{
+	const int kObjects = 10000;
+	const std::size_t kBytes = 48;
+	std::size_t index = SizeClass::Index(kBytes);
+
+	PoolStats before = ConcurrentGetStats();
+	std::vector<void*> ptrs(kObjects);
+	for (int i = 0; i < kObjects; ++i)
+	{
+		ptrs[i] = ConcurrentAlloc(kBytes);
+		memset(ptrs[i], i & 0xff, kBytes);
+	}
+	PoolStats allocated = ConcurrentGetStats();
+
+	std::thread consumer([&]() {
+		for (int i = 0; i < kObjects; ++i)
+		{
+			assert(*(unsigned char*)ptrs[i] == (i & 0xff));
+			ConcurrentDealloc(ptrs[i], kBytes);
+		}
+	});
+	consumer.join();
+
+	for (int i = 0; i < kObjects; ++i)
+	{
+		ptrs[i] = ConcurrentAlloc(kBytes);
+	}
+	PoolStats after = ConcurrentGetStats();
+	for (int i = 0; i < kObjects; ++i)
+	{
+		ConcurrentDealloc(ptrs[i], kBytes);
+	}
+
+	const ClassStats& b = before.classes[index];
+	const ClassStats& a = after.classes[index];
+#if defined(CONCURRENT_POOL_REMOTE_FREE) && !defined(CONCURRENT_POOL_NO_STATS) && !defined(CONCURRENT_POOL_PER_CPU)
+	// 释放全部进入远程释放链表，之后全部被取回
+	assert(a.remote_free_objects - b.remote_free_objects == kObjects);
+	assert(a.remote_reclaim_objects - b.remote_reclaim_objects >= kObjects);
+#endif
+	// 释放的内存块都能再次使用，第二轮不需要新的span
+	assert(a.span_bytes <= allocated.classes[index].span_bytes);
+	cout << "RemoteFreeTest: remote " << a.remote_free_objects - b.remote_free_objects
+		<< ", reclaimed " << a.remote_reclaim_objects - b.remote_reclaim_objects << endl;
+}
+
+// 热点桶的最大长度应增长到不再向central cache申请，且不影响其他桶的批大小
+void AdaptiveLengthTest()
+{
+	std::thread([]() {
+		static const int kRounds = 600, kObjects = 2000;
+		static const std::size_t kHot = 32, kCold = 5000;
+		std::size_t hot = SizeClass::Index(kHot), cold = SizeClass::Index(kCold);
+
+		std::vector<void*> ptrs(kObjects);
+		std::uint64_t lastFetches = 0;
+		for (int j = 0; j < kRounds; ++j)
+		{
+			std::uint64_t before = ConcurrentGetStats().classes[hot].fetch_count;
+			for (int i = 0; i < kObjects; ++i)
+				ptrs[i] = ConcurrentAlloc(kHot);
+			for (int i = 0; i < kObjects; ++i)
+				ConcurrentDealloc(ptrs[i], kHot);
+			lastFetches = ConcurrentGetStats().classes[hot].fetch_count - before;
+		}
+
+		// 退出的线程把缓存的内存整批归还，中转缓存中已有kCold的整批内存
+		// per-CPU缓存由同一CPU上的线程共用，线程退出时不归还，不适用
+		if (!CpuCache::Enabled())
+		{
+			std::thread([]() {
+				std::vector<void*> cold(kObjects);
+				for (void*& ptr : cold)
+					ptr = ConcurrentAlloc(kCold);
+				for (void* ptr : cold)
+					ConcurrentDealloc(ptr, kCold);
+			}).join();
+		}
+
+		PoolStats before = ConcurrentGetStats();
+		void* ptr = ConcurrentAlloc(kCold);
+		PoolStats after = ConcurrentGetStats();
+		ConcurrentDealloc(ptr, kCold);
+
+		std::uint64_t coldFetched = after.classes[cold].fetch_objects - before.classes[cold].fetch_objects;
+#ifndef CONCURRENT_POOL_NO_STATS
+		assert(lastFetches == 0);
+		assert(coldFetched == 1);
+#endif
+		cout << "AdaptiveLengthTest: hot fetches in last round " << lastFetches
+			<< ", cold fetched " << coldFetched << endl;
+	}).join();
+}
+
+// 设置较小的合计预算后，各线程缓存的空闲内存之和应受其限制
+void ThreadCacheBudgetTest()
+{
+	const int kThreads = 8, kObjects = 4000;
+	const std::size_t kBudget = 1024 * 1024;
+	std::size_t old = ThreadCache::TotalBudget();
+	ConcurrentSetThreadCacheBudget(kBudget);
+
+	std::atomic<int> done{ 0 }, touched{ 0 }, round{ 0 };
+	std::atomic<bool> exit{ false };
+	std::vector<std::thread> vt;
+	for (int t = 0; t < kThreads; ++t)
+	{
+		vt.emplace_back([&]() {
+			std::vector<void*> ptrs(kObjects);
+			for (int j = 0; j < 4; ++j)
+			{
+				for (int i = 0; i < kObjects; ++i)
+					ptrs[i] = ConcurrentAlloc((i % 8 + 1) * 256);
+				for (int i = 0; i < kObjects; ++i)
+					ConcurrentDealloc(ptrs[i]);
+			}
+			++done;
+
+			// 预算被其他线程偷取后，下次释放时才会归还多出的内存
+			// 第一轮中的释放仍可能偷取，第二轮时被偷取者归还，不再偷取
+			for (int r = 1; r <= 2; ++r)
+			{
+				while (round < r)
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				ConcurrentDealloc(ConcurrentAlloc(256));
+				++touched;
+			}
+
+			while (!exit)
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		});
+	}
+	while (done != kThreads)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	for (int r = 1; r <= 2; ++r)
+	{
+		round = r;
+		ConcurrentDealloc(ConcurrentAlloc(256));
+		while (touched != r * kThreads)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	PoolStats stats = ConcurrentGetStats();
+	std::size_t cached = 0, budget = 0;
+	for (std::size_t i = 0; i < stats.thread_caches && i < PoolStats::kMaxThreadStats; ++i)
+	{
+		cached += stats.threads[i].cached_bytes;
+		budget += stats.threads[i].budget_bytes;
+	}
+	exit = true;
+	for (auto& t : vt)
+		t.join();
+	ConcurrentSetThreadCacheBudget(old);
+
+	cout << "ThreadCacheBudgetTest: cached " << cached / 1024 << "KB, claimed " << budget / 1024
+		<< "KB of " << kBudget / 1024 << "KB" << endl;
+	assert(stats.thread_cache_budget == kBudget);
+	// 已分配的预算与缓存的内存都不超过设置的合计预算，不限制时约为8M
+	assert(stats.thread_cache_claimed_budget <= kBudget);
+	assert(cached <= kBudget);
+}
+
+// 多个线程并发申请释放，一部分线程启用本地链表，一部分对象由其他线程释放
+struct PoolNode
+{
+	std::uint64_t id = 0;
+	int value = 42;
+};
+
+void ConcurrentObjectPoolTest()
+{
+	using Pool = ConcurrentObjectPool<PoolNode>;
+	const int kThreads = 8, kObjects = 5000, kRounds = 4;
+
+	// 每个线程把前一半对象交给下一个线程释放
+	std::vector<std::vector<PoolNode*>> handoff(kThreads);
+	std::vector<std::thread> vt;
+	for (int t = 0; t < kThreads; ++t)
+	{
+		vt.emplace_back([&, t]() {
+			if (t % 2 == 0)
+				Pool::AttachThread();
+
+			std::vector<PoolNode*> ptrs(kObjects);
+			for (int r = 0; r < kRounds; ++r)
+			{
+				for (int i = 0; i < kObjects; ++i)
+				{
+					ptrs[i] = Pool::New();
+					assert(ptrs[i]->value == 42);
+					assert((std::uintptr_t)ptrs[i] % alignof(PoolNode) == 0);
+					ptrs[i]->id = ((std::uint64_t)t << 32) | i;
+				}
+				for (int i = 0; i < kObjects; ++i)
+				{
+					assert(ptrs[i]->id == (((std::uint64_t)t << 32) | i));
+					if (r < kRounds - 1 || i >= kObjects / 2)
+						Pool::Delete(ptrs[i]);
+				}
+			}
+			handoff[t].assign(ptrs.begin(), ptrs.begin() + kObjects / 2);
+		});
+	}
+	for (auto& t : vt)
+		t.join();
+	vt.clear();
+
+	for (int t = 0; t < kThreads; ++t)
+	{
+		vt.emplace_back([&, t]() {
+			Pool::AttachThread();
+			for (PoolNode* node : handoff[(t + 1) % kThreads])
+				Pool::Delete(node);
+		});
+	}
+	for (auto& t : vt)
+		t.join();
+
+	// 对象被反复复用，内存约为同时存活的对象数
+	std::size_t bytes = Pool::MemoryBytes();
+	cout << "ConcurrentObjectPoolTest: " << bytes / 1024 << "KB" << endl;
+	assert(bytes <= 2 * kThreads * kObjects * sizeof(PoolNode) + kThreads * 128 * 1024);
+}
+
+// 标准库容器通过PoolAllocator与ConcurrentMemoryResource使用内存池
+void ContainerAllocatorTest()
+{
+	PoolStats before = ConcurrentGetStats();
+	{
+		std::map<int, std::string, std::less<int>, PoolAllocator<std::pair<const int, std::string>>> m;
+		std::vector<int, PoolAllocator<int>> v;
+		for (int i = 0; i < 10000; ++i)
+		{
+			m.emplace(i, std::to_string(i));
+			v.push_back(i);
+		}
+		for (int i = 0; i < 10000; i += 2)
+			m.erase(i);
+		assert(m.size() == 5000 && m.begin()->second == "1");
+		assert(v.size() == 10000 && v.back() == 9999);
+
+		// 超过一页的对齐
+		struct alignas(16384) Big { char data[16384]; };
+		std::vector<Big, PoolAllocator<Big>> big(3);
+		assert((std::uintptr_t)big.data() % alignof(Big) == 0);
+
+		std::pmr::unordered_map<int, int> um(ConcurrentMemoryResource());
+		for (int i = 0; i < 10000; ++i)
+			um[i] = i * 2;
+		assert(um.size() == 10000 && um[1234] == 2468);
+
+		// 大小不是对齐的倍数
+		std::pmr::memory_resource* mr = ConcurrentMemoryResource();
+		void* p = mr->allocate(24, 16);
+		assert((std::uintptr_t)p % 16 == 0);
+		mr->deallocate(p, 24, 16);
+		assert(mr->is_equal(*ConcurrentMemoryResource()));
+		assert(!mr->is_equal(*std::pmr::new_delete_resource()));
+	}
+	PoolStats after = ConcurrentGetStats();
+
+	std::uint64_t allocs = 0;
+	for (std::size_t i = 0; i < kNFreeList; ++i)
+		allocs += after.classes[i].alloc_count - before.classes[i].alloc_count;
+#if !defined(CONCURRENT_POOL_NO_STATS) && !defined(CONCURRENT_POOL_PER_CPU)
+	assert(allocs >= 20000);
+#endif
+	cout << "ContainerAllocatorTest: " << allocs << " small allocations through the pool" << endl;
+}
+
+// 跨越叶子节点(或数组的系统页)边界批量建立映射，再逐页查询
+template <class Map>
+static void CheckPageMap(Map& map, std::size_t boundary)
+{
+	map.Init();
+	Span a, b;
+	std::size_t start = boundary - 3;
+	map.set_range(start, 10, &a);
+	for (std::size_t id = start; id < start + 10; ++id)
+		assert(map.get(id) == &a);
+	assert(map.get(start - 1) == nullptr && map.get(start + 10) == nullptr);
+
+	map.set(start + 5, &b);
+	assert(map.get(start + 4) == &a && map.get(start + 5) == &b && map.get(start + 6) == &a);
+
+	// 超出范围的页号
+	assert(map.get(~(std::uintptr_t)0 >> 1) == nullptr);
+	assert(map.MemoryBytes() > 0);
+}
+
+void PageMapTest()
+{
+	PageMap2<17> map2;
+	CheckPageMap(map2, 1 << 15);
+	PageMap3<64 - kPageShift> map3;
+	CheckPageMap(map3, 1 << 17);
+#ifdef __linux__
+	PageMapFlat<20> flat;
+	CheckPageMap(flat, 4096 / sizeof(Span*));
+#endif
+	cout << "PageMapTest: ok" << endl;
+}
+
+// 小对象所在页在紧凑映射中记录桶下标，大对象为0
+void PageClassTest()
+{
+	for (std::size_t bytes : { 8, 100, 1000, 5000, 60000 })
+	{
+		void* ptr = ConcurrentAlloc(bytes);
+		std::size_t id = (std::size_t)ptr >> kPageShift;
+		assert(PageCache::_idClassMap.get(id) == SizeClass::Index(bytes) + 1);
+		ConcurrentDealloc(ptr);
+	}
+
+	void* large = ConcurrentAlloc(kMaxBytes + 1);
+	assert(PageCache::_idClassMap.get((std::size_t)large >> kPageShift) == 0);
+	ConcurrentDealloc(large);
+	cout << "PageClassTest: ok" << endl;
+}
+
+void SpanSlotTest()
+{
+	static_assert(sizeof(Span) % 64 == 0 && alignof(Span) == 64, "Span must be cache-line aligned");
+
+	// 新线程中连续申请多个span的内存块，每个都应位于span内对象的边界上且互不重复
+	std::thread([]() {
+		for (std::size_t bytes : { 8, 48, 1000, 20000 })
+		{
+			std::size_t index = SizeClass::Index(bytes);
+			std::size_t size = SizeClass::ClassSize(index);
+			std::size_t objects = SizeClass::NumOfObjects(index);
+
+			std::vector<void*> ptrs(3 * objects);
+			std::unordered_map<void*, bool> seen;
+			for (void*& ptr : ptrs)
+			{
+				ptr = ConcurrentAlloc(bytes);
+				assert(seen.emplace(ptr, true).second);
+
+				Span* span = PageCache::_idSpanMap.get((std::size_t)ptr >> kPageShift);
+				std::size_t offset = (char*)ptr - (char*)(span->page_id << kPageShift);
+				assert(span->obj_size == size && span->use_count <= objects);
+				assert(offset % size == 0 && SizeClass::SlotOf(index, offset) == offset / size);
+				assert(SizeClass::SlotOf(index, offset) < objects);
+			}
+
+			// 交错释放，span中的空闲内存块不连续
+			for (std::size_t i = 0; i < ptrs.size(); i += 2)
+				ConcurrentDealloc(ptrs[i], bytes);
+			for (std::size_t i = 1; i < ptrs.size(); i += 2)
+				ConcurrentDealloc(ptrs[i], bytes);
+		}
+	}).join();
+	cout << "SpanSlotTest: ok" << endl;
+}
+
+void LazyCarveTest()
+{
+#ifndef CONCURRENT_POOL_SPAN_BITMAP
+	// 其他测试未使用的桶，第一次申请时取得新的span
+	std::thread([]() {
+		const std::size_t bytes = 3968;
+		std::size_t index = SizeClass::Index(bytes);
+		std::size_t objects = SizeClass::NumOfObjects(index);
+
+		std::vector<void*> ptrs;
+		ptrs.push_back(ConcurrentAlloc(bytes));
+		Span* span = PageCache::_idSpanMap.get((std::size_t)ptrs[0] >> kPageShift);
+		// 只切出了取走的一批，span尾部未被写入
+		assert(span->carved == span->use_count && span->carved < objects);
+		assert(ptrs[0] == (void*)(span->page_id << kPageShift));
+
+		// 切完整个span，按地址顺序分出
+		while (span->carved < objects)
+			ptrs.push_back(ConcurrentAlloc(bytes));
+		for (std::size_t i = 1; i < ptrs.size(); ++i)
+			assert((char*)ptrs[i] == (char*)ptrs[i - 1] + SizeClass::ClassSize(index));
+
+		for (void* ptr : ptrs)
+			ConcurrentDealloc(ptr, bytes);
+	}).join();
+#endif
+	cout << "LazyCarveTest: ok" << endl;
+}
+
+// 线程退出后中转缓存中空闲的批被还给span，不再使用的桶把span全部还给page cache
+void TransferDrainTest()
+{
+	// 其他测试未使用的桶，一个由后台线程归还，一个由ConcurrentReleaseMemory归还
+	for (std::size_t bytes : { 7000, 12000 })
+	{
+		std::size_t index = SizeClass::Index(bytes);
+		std::thread([bytes]() {
+			std::vector<void*> ptrs(1000);
+			for (void*& ptr : ptrs)
+				ptr = ConcurrentAlloc(bytes);
+			for (void* ptr : ptrs)
+				ConcurrentDealloc(ptr, bytes);
+		}).join();
+
+		// per-CPU缓存不随线程退出清空，内存块不会进入中转缓存
+		ClassStats before = ConcurrentGetStats().classes[index];
+		if (!CpuCache::Enabled())
+			assert(before.transfer_cache_bytes > 0 && before.span_bytes > 0);
+
+		if (bytes == 7000)
+		{
+			ConcurrentStartScavenger(0, 1024 * 1024 * 1024);
+			std::this_thread::sleep_for(std::chrono::milliseconds(500));
+			ConcurrentStopScavenger();
+		}
+		else
+		{
+			ConcurrentReleaseMemory(SIZE_MAX);
+		}
+
+		ClassStats after = ConcurrentGetStats().classes[index];
+		cout << "TransferDrainTest: " << bytes << " bytes, transfer " << before.transfer_cache_bytes / 1024 << "KB -> "
+			<< after.transfer_cache_bytes / 1024 << "KB, spans " << before.span_bytes / 1024 << "KB -> "
+			<< after.span_bytes / 1024 << "KB" << endl;
+		if (!CpuCache::Enabled())
+			assert(after.transfer_cache_bytes == 0 && after.span_bytes == 0);
+	}
+}
+
 int main()
 {
+	ScavengeTest();
+	HugePageReturnTest();
+	ThreadExitTest();
+	AlignedAllocTest();
+	ReallocTest();
+	StatsTest();
+	ProfileTest();
+	RemoteFreeTest();
+	AdaptiveLengthTest();
+	ThreadCacheBudgetTest();
+	ConcurrentObjectPoolTest();
+	ContainerAllocatorTest();
+	PageMapTest();
+	PageClassTest();
+	SpanSlotTest();
+	LazyCarveTest();
+	TransferDrainTest();
 	//ThreadCacheTest();
 	//ConcurrentTest3();
 	MultiThreadTest();
@@ -3,23 +3,38 @@
 #include "centralCache.h"
 #include "pageCache.h"
 
+std::mutex ThreadCache::_registryMtx;
+ThreadCache* ThreadCache::_list = nullptr;
+ThreadCache* ThreadCache::_stealCursor = nullptr;
+PoolStats ThreadCache::_exitedStats;
+
+// 默认所有thread cache合计最多缓存32M
+std::atomic<std::size_t> ThreadCache::_totalBudget{ 32 * 1024 * 1024 };
+std::atomic<std::int64_t> ThreadCache::_unclaimedBudget{ 32 * 1024 * 1024 };
+
 void* ThreadCache::Allocate(std::size_t bytes)
 {
 	if (bytes == 0)
 		bytes = 1;
 
 	// 找到目标自由链表（下标）
-	std::size_t realBytes = SizeClass::RoundUp(bytes);
-	std::size_t i = SizeClass::Index(realBytes);
+	std::size_t i = SizeClass::Index(bytes);
+	std::size_t realBytes = SizeClass::ClassSize(i);
+	Count(&ClassCounters::alloc, i);
 
 	// 若自由链表为空, 从central cache中申请
 	if (_freeLists[i].empty())
 	{
+		_lengths[i].low_water = 0;
 		return FetchFromCentralCache(realBytes, i);
 	}
 	else
 	{
-		return _freeLists[i].pop_front();
+		void* ptr = _freeLists[i].pop_front();
+		AddSize(-(std::ptrdiff_t)realBytes);
+		if (_freeLists[i].size() < _lengths[i].low_water)
+			_lengths[i].low_water = (std::uint32_t)_freeLists[i].size();
+		return ptr;
 	}
 }
 
@@ -35,30 +50,100 @@ void ThreadCache::Deallocate(void* ptr)
 	std::size_t bytes = PageCache::_idSpanMap.get(id)->obj_size;
 	//pageCache._pageMtx.unlock();
 
+	Deallocate(ptr, bytes);
+}
+
+void ThreadCache::Deallocate(void* ptr, std::size_t bytes)
+{
+	if (ptr == nullptr)
+		return;
+
+	if (bytes == 0)
+		bytes = 1;
+
 	std::size_t i = SizeClass::Index(bytes);
+	Count(&ClassCounters::free, i);
 
+#ifdef CONCURRENT_POOL_REMOTE_FREE
+	// 其他线程持有的span，放入其远程释放链表，由持有者取回
+	Span* span = PageCache::_idSpanMap.get((std::size_t)ptr >> kPageShift);
+	if (span->owner.load(std::memory_order_relaxed) != this)
+	{
+		CentralCache::GetInstance().RemoteFree(span, ptr, i);
+		Count(&ClassCounters::remote, i);
+
+		// 预算被偷取后也要在释放时归还
+		if (_size.load(std::memory_order_relaxed) > _maxSize.load(std::memory_order_relaxed))
+			OverBudget();
+		return;
+	}
+#endif
 
 	// 归还到自由链表中，若链表长度大于最大申请数量就继续向central cache归还
 	_freeLists[i].push_front(ptr);
+	AddSize(SizeClass::ClassSize(i));
 
-	if (_freeLists[i].size() > _maxGetSize)
+	if (_freeLists[i].size() > _lengths[i].max_length)
 	{
 		ListTooLong(i);
 	}
+
+	// 整个thread cache超出预算
+	if (_size.load(std::memory_order_relaxed) > _maxSize.load(std::memory_order_relaxed))
+	{
+		OverBudget();
+	}
 }
 
 void* ThreadCache::FetchFromCentralCache(std::size_t bytes, std::size_t index)
 {
 	// 预期可拿到的内存块数量
-	std::size_t fetchNum = (std::min)(_maxGetSize, SizeClass::NumOfMoveSize(bytes));
-	// _maxGetSize采用慢增长策略
-	if (_maxGetSize == fetchNum)
-		IncreaseGetSize();
+	ClassLength& length = _lengths[index];
+	std::size_t batch = SizeClass::BatchSize(index);
+	std::size_t fetchNum = (std::min)((std::size_t)length.max_length, batch);
+
+	// 多拿的内存块不能使缓存超出预算，至少拿一个返回给调用者
+	std::size_t size = _size.load(std::memory_order_relaxed), maxSize = _maxSize.load(std::memory_order_relaxed);
+	std::size_t room = size < maxSize ? (maxSize - size) / bytes : 0;
+	fetchNum = (std::min)(fetchNum, room + 1);
+
+	// 慢启动: 不足一批时每次加1，之后每次加一批，直到kMaxBatches批
+	if (length.max_length < batch)
+		length.max_length += 1;
+	else
+		length.max_length = (std::uint32_t)(std::min)(length.max_length + batch, kMaxBatches * batch);
+
+	Touch();
+	if (++_slowOps == kScavengeInterval)
+		Scavenge();
 
 	void* begin = nullptr, * end = nullptr;
 	CentralCache& centralIns = CentralCache::GetInstance();
+
+#ifdef CONCURRENT_POOL_REMOTE_FREE
+	// 优先整批取回其他线程释放的内存块，不必加锁
+	std::size_t reclaimed = centralIns.ReclaimRemote(begin, end, index);
+	if (reclaimed > 0)
+	{
+		Count(&ClassCounters::reclaimed, index, reclaimed);
+		void* res = begin;
+		if (reclaimed > 1)
+		{
+			_freeLists[index].push_front(FreeList_next(begin), end, reclaimed - 1);
+			AddSize((reclaimed - 1) * bytes);
+		}
+
+		// 取回的数量不受max_length限制，可能一次超出预算
+		if (_size.load(std::memory_order_relaxed) > _maxSize.load(std::memory_order_relaxed))
+			OverBudget();
+		return res;
+	}
+#endif
+
 	// fetchNum更新为实际数量
-	fetchNum = centralIns.FetchRange(begin, end, fetchNum, index, bytes);
+	fetchNum = centralIns.FetchRange(begin, end, fetchNum, index, bytes, this);
+	Count(&ClassCounters::fetch, index);
+	Count(&ClassCounters::fetched, index, fetchNum);
 
 	if (fetchNum == 1)
 	{
@@ -70,22 +155,264 @@ void* ThreadCache::FetchFromCentralCache(std::size_t bytes, std::size_t index)
 		void* res = begin;
 		begin = FreeList_next(begin);
 		_freeLists[index].push_front(begin, end, fetchNum - 1);
+		AddSize((fetchNum - 1) * bytes);
+
+		// 中转缓存中的整批可能超出上面的估计，预算也可能已被偷取
+		if (_size.load(std::memory_order_relaxed) > _maxSize.load(std::memory_order_relaxed))
+			OverBudget();
 		return res;
 	}
 
 }
 
-void ThreadCache::ListTooLong(std::size_t index)
+void ThreadCache::ReleaseToCentralCache(std::size_t index, std::size_t num)
 {
-	// 一次归还的数量
-	std::size_t batchNum = _maxGetSize;
-
 	// 拿到归还部分的头尾
 	void* head, * tail = nullptr;
-	_freeLists[index].pop_front(head, tail, batchNum);
+	_freeLists[index].pop_front(head, tail, num);
 
-	CentralCache& central = CentralCache::GetInstance();
 	// 向central cache归还
-	central.ReleaseToSpans(head, tail, index);
+	CentralCache::GetInstance().ReleaseRange(head, tail, num, index);
+	AddSize(-(std::ptrdiff_t)(num * SizeClass::ClassSize(index)));
+	Count(&ClassCounters::release, index);
+	Count(&ClassCounters::released, index, num);
+
+	ClassLength& length = _lengths[index];
+	length.low_water = (std::min)(length.low_water, (std::uint32_t)_freeLists[index].size());
 }
 
+void ThreadCache::ListTooLong(std::size_t index)
+{
+	// 一次归还一批
+	ClassLength& length = _lengths[index];
+	std::size_t batch = SizeClass::BatchSize(index);
+	ReleaseToCentralCache(index, (std::min)(batch, _freeLists[index].size()));
+
+	// 不足一批时仍在慢启动，之后反复超出说明释放多于申请，缩短一批
+	if (length.max_length < batch)
+	{
+		length.max_length += 1;
+	}
+	else if (length.max_length > batch && ++length.overages > kMaxOverages)
+	{
+		length.max_length -= (std::uint32_t)batch;
+		length.overages = 0;
+	}
+
+	Touch();
+	if (++_slowOps == kScavengeInterval)
+		Scavenge();
+}
+
+void ThreadCache::Scavenge()
+{
+	_slowOps = 0;
+	for (std::size_t i = 0; i < kNFreeList; ++i)
+	{
+		ClassLength& length = _lengths[i];
+		std::size_t lowWater = length.low_water;
+		length.low_water = (std::uint32_t)_freeLists[i].size();
+		if (lowWater == 0)
+			continue;
+
+		// 低水位以下的内存块上次检查以来从未用到，归还一半，长期不用的桶会逐次减半直到清空
+		ReleaseToCentralCache(i, (lowWater + 1) / 2);
+
+		std::size_t batch = SizeClass::BatchSize(i);
+		if (length.max_length > batch)
+			length.max_length = (std::uint32_t)(std::max)(length.max_length - batch, batch);
+	}
+}
+
+void ThreadCache::ReleaseAll()
+{
+	for (std::size_t i = 0; i < kNFreeList; ++i)
+	{
+#ifdef CONCURRENT_POOL_REMOTE_FREE
+		// 待回收的内存块可能只有本线程会取回，一并归还
+		void* begin = nullptr, * end = nullptr;
+		std::size_t reclaimed = CentralCache::GetInstance().ReclaimRemote(begin, end, i);
+		if (reclaimed > 0)
+		{
+			_freeLists[i].push_front(begin, end, reclaimed);
+			AddSize(reclaimed * SizeClass::ClassSize(i));
+			Count(&ClassCounters::reclaimed, i, reclaimed);
+		}
+#endif
+		if (!_freeLists[i].empty())
+			ReleaseToCentralCache(i, _freeLists[i].size());
+	}
+}
+
+void ThreadCache::OverBudget()
+{
+	// 计为一次慢路径，与ListTooLong相同每kScavengeInterval次才扫描所有桶的低水位
+	Touch();
+	if (++_slowOps == kScavengeInterval)
+		Scavenge();
+
+	// 因预算被偷取而超出时说明本线程空闲，直接归还，避免再去偷取其他空闲的thread cache
+	if (!_stolen.exchange(false, std::memory_order_relaxed))
+		IncreaseCacheLimit();
+
+	// 仍然超出时从大对象的桶开始各归还一半，降到预算的3/4以下，之后的释放不会立即再次超出
+	// 一轮之后仍然超出(预算很小或只剩小对象)时再来一轮，每轮至少归还一个内存块
+	// 预算随时可能被偷取，每轮重新计算目标
+	while (_size.load(std::memory_order_relaxed) > _maxSize.load(std::memory_order_relaxed))
+	{
+		std::size_t target = _maxSize.load(std::memory_order_relaxed) / 4 * 3;
+		for (std::size_t i = kNFreeList; i-- > 0; )
+		{
+			if (!_freeLists[i].empty())
+				ReleaseToCentralCache(i, (_freeLists[i].size() + 1) / 2);
+			if (_size.load(std::memory_order_relaxed) <= target)
+				break;
+		}
+	}
+}
+
+void ThreadCache::IncreaseCacheLimit()
+{
+	if (_maxSize.load(std::memory_order_relaxed) >= kMaxSize)
+		return;
+
+	// 先从未分配的预算中领取
+	std::size_t claimed = ClaimBudget(kStealAmount);
+	if (claimed > 0)
+	{
+		_maxSize.fetch_add(claimed, std::memory_order_relaxed);
+		return;
+	}
+
+	// 从上次的位置开始依次检查，只偷取期间没有进入过慢路径的thread cache
+	std::lock_guard<std::mutex> lk(_registryMtx);
+	ThreadCache* victim = _stealCursor;
+	for (int i = 0; i < kMaxStealTries && _list != nullptr; ++i)
+	{
+		if (victim == nullptr)
+			victim = _list;
+
+		std::uint64_t activity = victim->_activity.load(std::memory_order_relaxed);
+		bool idle = activity == victim->_seenActivity;
+		victim->_seenActivity = activity;
+
+		if (victim != this && idle && victim->_maxSize.load(std::memory_order_relaxed) > kMinSize)
+		{
+			// 只有持有_registryMtx时才会减少，检查之后不会低于kMinSize
+			victim->_maxSize.fetch_sub(kStealAmount, std::memory_order_relaxed);
+			victim->_stolen.store(true, std::memory_order_relaxed);
+			// 合计预算被调小后已领取的超出部分，先用偷取的预算偿还
+			if (_unclaimedBudget.load(std::memory_order_relaxed) < 0)
+				_unclaimedBudget.fetch_add(kStealAmount, std::memory_order_relaxed);
+			else
+				_maxSize.fetch_add(kStealAmount, std::memory_order_relaxed);
+			_stealCursor = victim->_next;
+			return;
+		}
+		victim = victim->_next;
+	}
+	_stealCursor = victim;
+}
+
+std::size_t ThreadCache::ClaimBudget(std::size_t bytes)
+{
+	std::int64_t unclaimed = _unclaimedBudget.load(std::memory_order_relaxed);
+	std::size_t claimed;
+	do
+	{
+		if (unclaimed <= 0)
+			return 0;
+		claimed = (std::min)(bytes, (std::size_t)unclaimed);
+	} while (!_unclaimedBudget.compare_exchange_weak(unclaimed, unclaimed - (std::int64_t)claimed, std::memory_order_relaxed));
+	return claimed;
+}
+
+void ThreadCache::Register(ThreadCache* tc)
+{
+	// 预算已分完时从0开始，之后超出预算时再偷取
+	tc->_maxSize.store(ClaimBudget(kMinSize), std::memory_order_relaxed);
+
+	std::lock_guard<std::mutex> lk(_registryMtx);
+	tc->_next = _list;
+	if (_list != nullptr)
+		_list->_prev = tc;
+	_list = tc;
+}
+
+void ThreadCache::Unregister(ThreadCache* tc)
+{
+	std::lock_guard<std::mutex> lk(_registryMtx);
+	tc->CollectStats(_exitedStats);
+	_unclaimedBudget.fetch_add(tc->_maxSize.load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+	if (_stealCursor == tc)
+		_stealCursor = tc->_next;
+	if (tc->_prev != nullptr)
+		tc->_prev->_next = tc->_next;
+	else
+		_list = tc->_next;
+	if (tc->_next != nullptr)
+		tc->_next->_prev = tc->_prev;
+}
+
+void ThreadCache::CollectAllStats(PoolStats& stats)
+{
+	std::lock_guard<std::mutex> lk(_registryMtx);
+	stats = _exitedStats;
+
+	for (ThreadCache* tc = _list; tc != nullptr; tc = tc->_next)
+	{
+		tc->CollectStats(stats);
+
+		std::size_t budget = tc->_maxSize.load(std::memory_order_relaxed);
+		if (stats.thread_caches < PoolStats::kMaxThreadStats)
+		{
+			ThreadCacheStats& ts = stats.threads[stats.thread_caches];
+			ts.cached_bytes = tc->_size.load(std::memory_order_relaxed);
+			ts.budget_bytes = budget;
+		}
+		stats.thread_cache_claimed_budget += budget;
+		++stats.thread_caches;
+	}
+
+	stats.thread_cache_budget = _totalBudget.load(std::memory_order_relaxed);
+}
+
+void ThreadCache::SetTotalBudget(std::size_t bytes)
+{
+	std::lock_guard<std::mutex> lk(_registryMtx);
+	std::size_t old = _totalBudget.exchange(bytes, std::memory_order_relaxed);
+	_unclaimedBudget.fetch_add((std::int64_t)bytes - (std::int64_t)old, std::memory_order_relaxed);
+}
+
+void ThreadCache::CollectStats(PoolStats& stats) const
+{
+#ifndef CONCURRENT_POOL_NO_STATS
+	for (std::size_t i = 0; i < kNFreeList; ++i)
+	{
+		const ClassCounters& c = _counters[i];
+		ClassStats& cls = stats.classes[i];
+
+		// 先读出各计数，自由链表中的内存块数 = 申请到的 + 取回的 + 释放的 - 远程释放的 - 申请的 - 归还的
+		std::uint64_t alloc = c.alloc.Get(), free = c.free.Get();
+		std::uint64_t fetched = c.fetched.Get(), released = c.released.Get();
+		std::uint64_t remote = c.remote.Get(), reclaimed = c.reclaimed.Get();
+
+		cls.alloc_count += alloc;
+		cls.free_count += free;
+		cls.fetch_count += c.fetch.Get();
+		cls.fetch_objects += fetched;
+		cls.release_count += c.release.Get();
+		cls.release_objects += released;
+		cls.remote_free_objects += remote;
+		cls.remote_reclaim_objects += reclaimed;
+
+		// 与持有者并发读取时各计数不是同一时刻的值，结果可能暂时为负
+		std::int64_t cached = (std::int64_t)(fetched + reclaimed + free - remote - alloc - released);
+		if (cached > 0)
+			cls.thread_cache_bytes += (std::size_t)cached * SizeClass::ClassSize(i);
+	}
+#else
+	(void)stats;
+#endif
+}
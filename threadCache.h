@@ -1,23 +1,104 @@
 #pragma once
 #include "common.h"
+#include "stats.h"
 
+// 定义CONCURRENT_POOL_REMOTE_FREE时，span记录最近从中取走内存块的thread cache作为持有者
+// 其他线程释放的内存块不进入自己的自由链表，而是用一次CAS放入span的远程释放链表，
+// 持有者(或任何同一个桶的线程)在下次向central cache申请时不加锁地整批取回
+// 适合一个线程申请、另一个线程释放的场景，避免释放方反复经过central cache的锁
 class ThreadCache
 {
-	// 最大申请数量_maxGetSize每次增长的值
-	static constexpr int kIncrease = 1;
+	// 自由链表的最大长度不超过一次移动数量的kMaxBatches倍
+	static constexpr std::size_t kMaxBatches = 8;
+
+	// 连续超过最大长度这么多次后缩短最大长度
+	static constexpr std::uint32_t kMaxOverages = 3;
+
+	// 每经过这么多次慢路径(向central cache申请或归还)检查一次空闲的桶
+	static constexpr std::uint32_t kScavengeInterval = 1024;
+
+	// 每个thread cache注册时领取的预算与预算上限，以及每次领取或偷取的字节数
+	// 被偷取时不会低于kMinSize
+	static constexpr std::size_t kMinSize = 2 * kMaxBytes;
+	static constexpr std::size_t kMaxSize = 4 * 1024 * 1024;
+	static constexpr std::size_t kStealAmount = 64 * 1024;
+
+	// 偷取预算时最多检查的thread cache数量
+	static constexpr int kMaxStealTries = 16;
+
+	// 每个桶的自适应长度，参照tcmalloc
+	// 最大长度从1开始慢启动，每次申请时链表为空则增长，释放时反复超过最大长度或长期未用则缩短
+	struct ClassLength
+	{
+		// 自由链表的最大长度，也是一次向central cache申请数量的上限
+		std::uint32_t max_length = 1;
+		// 上次检查以来自由链表的最小长度，这部分一直未被用到
+		std::uint32_t low_water = 0;
+		// 超过最大长度的次数
+		std::uint32_t overages = 0;
+	};
+
 public:
 	// 申请与释放内存
 	void* Allocate(std::size_t bytes);
 
 	void Deallocate(void* ptr);
 
+	// 调用方给出对象大小，直接映射到自由链表，不再查询PageMap
+	void Deallocate(void* ptr, std::size_t bytes);
+
+
+	// 将所有自由链表归还central cache，线程退出时调用
+	void ReleaseAll();
+
+	// 第index个桶自由链表的最大长度
+	std::size_t MaxLength(std::size_t index) const
+	{
+		return _lengths[index].max_length;
+	}
+
+	// 将计数和缓存的字节数累加到stats中，可由其他线程调用
+	void CollectStats(PoolStats& stats) const;
+
+	// 新建的thread cache加入全局链表，并从未分配的预算中领取至多kMinSize字节
+	static void Register(ThreadCache* tc);
+
+	// 线程退出、ReleaseAll之后调用，移出全局链表，归还预算并保留计数
+	static void Unregister(ThreadCache* tc);
 
-	// 增加最大申请数量
-	void IncreaseGetSize()
+	// 将已退出线程与所有存活的thread cache的统计写入stats，覆盖stats原有的内容
+	static void CollectAllStats(PoolStats& stats);
+
+	// 设置所有thread cache合计最多缓存的字节数，已领取的预算超出时由之后的偷取逐步收回
+	static void SetTotalBudget(std::size_t bytes);
+
+	static std::size_t TotalBudget()
 	{
-		_maxGetSize += kIncrease;
+		return _totalBudget.load(std::memory_order_relaxed);
 	}
+
 private:
+	// 缓存的字节数超过预算时调用，先尝试增加预算，仍超出时从大对象的桶开始归还
+	void OverBudget();
+
+	// 从未分配的预算中领取至多bytes字节，返回实际领取的字节数，不会使其变为负数
+	static std::size_t ClaimBudget(std::size_t bytes);
+
+	// 从未分配的预算中领取，不足时从最近没有进入慢路径的thread cache偷取
+	// 被偷取者下次释放时发现超出预算，从而归还内存
+	void IncreaseCacheLimit();
+
+	// 调整自由链表中的字节数，只由持有者调用
+	void AddSize(std::ptrdiff_t bytes)
+	{
+		_size.store(_size.load(std::memory_order_relaxed) + bytes, std::memory_order_relaxed);
+	}
+
+	// 记录一次慢路径，用于判断是否空闲
+	void Touch()
+	{
+		_activity.store(_activity.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
 
 	// 从central cache中获取内存
 	void* FetchFromCentralCache(std::size_t bytes, std::size_t index);
@@ -25,11 +106,63 @@ private:
 	// 将thread cache中的自由链表归还span中
 	void ListTooLong(std::size_t index);
 
+	// 将第index个桶的前num个内存块归还central cache
+	void ReleaseToCentralCache(std::size_t index, std::size_t num);
+
+	// 每kScavengeInterval次慢路径调用一次，将各桶低水位以下一直未用到的内存块归还一半并缩短最大长度
+	void Scavenge();
+
+	// 累加第index个桶的计数，定义CONCURRENT_POOL_NO_STATS时为空
+	void Count(StatCounter ClassCounters::* counter, std::size_t index, std::uint64_t n = 1)
+	{
+#ifndef CONCURRENT_POOL_NO_STATS
+		(_counters[index].*counter).Add(n);
+#else
+		(void)counter;
+		(void)index;
+		(void)n;
+#endif
+	}
+
 
 	FreeList _freeLists[kNFreeList];
 
-	// 最多可从central cache中申请的内存块的数量
-	std::size_t _maxGetSize = 1;
+	ClassLength _lengths[kNFreeList];
+
+	// 距下一次Scavenge的慢路径次数
+	std::uint32_t _slowOps = 0;
+
+	// 自由链表中的字节数，只由持有者修改
+	std::atomic<std::size_t> _size{ 0 };
+	// 预算，持有者增加，偷取者减少
+	// 注册时从至多kMinSize开始，不注册的per-CPU缓存固定为kMaxSize
+	std::atomic<std::size_t> _maxSize{ kMaxSize };
+	// 慢路径次数，以及偷取者上次检查时看到的值，两者相等说明期间一直空闲
+	std::atomic<std::uint64_t> _activity{ 0 };
+	std::uint64_t _seenActivity = 0;
+	// 被偷取过预算，下次超出预算时只归还内存，不再偷取其他thread cache
+	std::atomic<bool> _stolen{ false };
+
+	// 所有存活的thread cache组成的双向链表，由_registryMtx保护
+	ThreadCache* _next = nullptr;
+	ThreadCache* _prev = nullptr;
+
+	static std::mutex _registryMtx;
+	static ThreadCache* _list;
+	// 下一次偷取从这里开始检查
+	static ThreadCache* _stealCursor;
+	// 已退出线程的计数
+	static PoolStats _exitedStats;
+
+	// 合计预算，以及尚未分配给任何thread cache的部分
+	// 后者只在调小合计预算后可能为负，之后偷取的预算先用于偿还
+	static std::atomic<std::size_t> _totalBudget;
+	static std::atomic<std::int64_t> _unclaimedBudget;
+
+#ifndef CONCURRENT_POOL_NO_STATS
+	// 每个桶的计数，只由持有者更新
+	ClassCounters _counters[kNFreeList];
+#endif
 };
 
 // 使用TLS线程本地存储，将数据和执行的特定的线程一一对应